@@ -6,24 +6,53 @@
 #endif // ArduinoNative
 
 #include <algorithm>
+#include <atomic>
 #include <bitset>
+#include <cerrno>
+#include <fcntl.h>
+#include <charconv>
 #include <cstring>
 #include <ctype.h>
 #include <cmath>
 #include <chrono>
+#include <climits>
+#include <cstddef>
+#include <condition_variable>
+#include <csignal>
+#include <functional>
 #include <iostream>
 #include <stdio.h>
 #include <iomanip>
+#include <memory>
+#include <mutex>
+#include <queue>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <thread>
+#include <type_traits>
 #include <unordered_map>
+#include <vector>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#endif
 
 /* CONSTANTS */
 #define LOW 0
 #define HIGH 1
 #define MSBFIRST 0
 #define LSBFIRST 1
+#define NO_IGNORE_CHAR '\x01'
 typedef enum {
         INPUT,
         OUTPUT,
@@ -36,9 +65,11 @@ typedef enum  {
         HEX
 } an_num_fmt_t;
 typedef enum : uint64_t {
+        AN_INT_LOW = LOW,
+        AN_INT_HIGH = HIGH,
         CHANGE,
+        FALLING,
         RISING,
-        FALLING
 } an_int_mode_t;
 typedef enum {
         SKIP_NONE,
@@ -63,6 +94,228 @@ typedef enum {
 #define AN_DEBUG_ANALOGWRITE
 #endif
 
+/* FUZZING */
+#ifdef AN_FUZZ
+#if defined(AN_RECORD) || defined(AN_REPLAY) || defined(AN_SHM)
+#error "AN_FUZZ can't be used with AN_RECORD, AN_REPLAY or AN_SHM"
+#endif
+// runs have to be repeatable and can't sleep
+#ifndef AN_VIRTUAL_TIME
+#define AN_VIRTUAL_TIME
+#endif
+// most loop() iterations of one run
+#ifndef AN_FUZZ_LOOPS
+#define AN_FUZZ_LOOPS 1000
+#endif
+// loop() iterations that still run after the last input was delivered
+#ifndef AN_FUZZ_SETTLE_LOOPS
+#define AN_FUZZ_SETTLE_LOOPS 4
+#endif
+#endif
+
+/* VIRTUAL TIME */
+#ifdef AN_VIRTUAL_TIME
+// time that passes for every loop() iteration, so sketches without delay() still advance
+#ifndef AN_VIRTUAL_LOOP_US
+#define AN_VIRTUAL_LOOP_US 10
+#endif
+#endif
+
+/* GENERATORS */
+// sample interval of sine generators
+#ifndef AN_SINE_STEP_US
+#define AN_SINE_STEP_US 1000
+#endif
+// samples in one period of the built-in waveform tables
+#ifndef AN_WAVE_SAMPLES
+#define AN_WAVE_SAMPLES 64
+#endif
+
+/* ADC */
+// time an analog conversion takes, the ATmega328P needs 13 ADC clocks at F_CPU / 128
+#ifndef AN_ADC_CONVERSION_US
+#ifdef AN_TEENSY_41
+#define AN_ADC_CONVERSION_US 17
+#else
+#define AN_ADC_CONVERSION_US 104
+#endif
+#endif
+
+/* SERIAL */
+// size of the Serial receive buffer, define as 64 to get the limit of the AVR hardware serial
+#ifndef AN_SERIAL_RX_BUFFER_SIZE
+#define AN_SERIAL_RX_BUFFER_SIZE 65536
+#endif
+
+// size of the Serial transmit buffer, output is written out in batches of at most this size
+#ifndef AN_SERIAL_TX_BUFFER_SIZE
+#define AN_SERIAL_TX_BUFFER_SIZE 4096
+#endif
+typedef enum {
+        AN_FLUSH_NEWLINE,
+        AN_FLUSH_FULL,
+        AN_FLUSH_ALWAYS,
+} an_flush_policy_t;
+
+/* WIRE */
+// size of the Wire transmit and receive buffers, 32 like on the AVR
+#ifndef AN_WIRE_BUFFER_SIZE
+#define AN_WIRE_BUFFER_SIZE 32
+#endif
+
+/* TONE */
+// sample rate of the PCM stream tone() is mixed into
+#ifndef AN_TONE_RATE
+#define AN_TONE_RATE 44100
+#endif
+// interval the mixer renders samples at while tones play
+#ifndef AN_TONE_BLOCK_US
+#define AN_TONE_BLOCK_US 10000
+#endif
+// define AN_TONE_FILE as a path to write the tones of the default board to, a WAV file or a named pipe
+
+/* SHARED MEMORY */
+#ifdef AN_SHM
+// POSIX shared memory segment the default board is published to
+#ifndef AN_SHM_NAME
+#define AN_SHM_NAME "/arduinonative"
+#endif
+#define an_shm_event(board, pin, old_value, new_value) an_shm_pin(board, pin, old_value, new_value)
+#else
+#define an_shm_event(board, pin, old_value, new_value)
+#endif
+
+/* SESSIONS */
+#if defined(AN_RECORD) && defined(AN_REPLAY)
+#error "AN_RECORD and AN_REPLAY can't be used together"
+#endif
+#if defined(AN_RECORD) || defined(AN_REPLAY)
+#define AN_SESSION
+// file the session of the default board is recorded to or replayed from
+#ifndef AN_SESSION_FILE
+#define AN_SESSION_FILE "an_session.bin"
+#endif
+#endif
+
+/* TRACING */
+#ifdef AN_TRACE
+// binary file the trace is written to
+#ifndef AN_TRACE_FILE
+#define AN_TRACE_FILE "an_trace.bin"
+#endif
+// number of records each thread can buffer before the writer drains them
+#ifndef AN_TRACE_RING_SIZE
+#define AN_TRACE_RING_SIZE 65536
+#endif
+#define an_trace_event(type, pin, old_value, new_value) an_trace_push(type, pin, old_value, new_value)
+#else
+#define an_trace_event(type, pin, old_value, new_value)
+#endif
+typedef enum : uint8_t {
+        AN_TRACE_PIN,
+        AN_TRACE_INT,
+        AN_TRACE_SERIAL_RX,
+        AN_TRACE_SERIAL_TX,
+} an_trace_type_t;
+/* For serial events pin is the port number and new_value the number of bytes */
+typedef struct an_trace_record {
+        uint64_t time_us;
+        float old_value;
+        float new_value;
+        an_trace_type_t type;
+        uint8_t pin;
+        uint16_t reserved;
+        uint32_t thread;
+} an_trace_record_t;
+typedef struct an_trace_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t record_size;
+} an_trace_header_t;
+
+/* PROFILING */
+typedef enum : uint8_t {
+        AN_PROF_DIGITALWRITE,
+        AN_PROF_DIGITALREAD,
+        AN_PROF_ANALOGWRITE,
+        AN_PROF_ANALOGREAD,
+        AN_PROF_SERIAL_PRINT,
+        AN_PROF_SHIFTOUT,
+        AN_PROF_SHIFTIN,
+        AN_PROF_PORT,
+        AN_PROF_PULSEIN,
+        AN_PROF_DELAY,
+        AN_PROF_DELAYMICROSECONDS,
+        AN_PROF_ISR,
+        AN_PROF_COUNT,
+} an_profile_api_t;
+#ifdef AN_PROFILE
+// file the JSON report is written to, the text report goes to stderr
+#ifndef AN_PROFILE_FILE
+#define AN_PROFILE_FILE "an_profile.json"
+#endif
+/* Cheap calls are only counted, calls that can block or take long are also timed */
+#define an_profile_call(api, pin) an_profile_count(api, pin)
+#define an_profile_time(api, pin) an_profile_scope an_profile_scope_local(api, pin)
+void an_profile_count(const an_profile_api_t api, const uint8_t pin);
+class an_profile_scope
+{
+private:
+        const an_profile_api_t api;
+        const uint8_t pin;
+        const std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+public:
+        an_profile_scope(const an_profile_api_t api, const uint8_t pin) : api(api), pin(pin) {}
+        ~an_profile_scope();
+};
+// writes the report now, it is also written at exit and on SIGUSR1
+void an_profile_report();
+#else
+#define an_profile_call(api, pin)
+#define an_profile_time(api, pin)
+#endif
+
+/* BOARD TRAITS */
+/* Every board is described by a trait type, selected below with the board macro.
+ * pin_count is the highest pin number + 1, the pin sets hold one bit per pin and
+ * adc_bits is the resolution of the converter. */
+typedef enum {
+        an_analog,
+        an_digital,
+        an_pwm,
+        an_int_pin,
+} an_pin_types_t;
+template <typename... T>
+constexpr uint64_t an_pin_bits(const T... pins) {return (0ULL | ... | (1ULL << pins));}
+constexpr uint64_t an_pin_range(const unsigned first, const unsigned last) {return (2ULL << last) - (1ULL << first);}
+
+struct an_board_uno {
+        static constexpr const char* name = "Arduino Uno";
+        static constexpr uint8_t pin_count = 20;
+        static constexpr uint64_t analog_pins = an_pin_range(14, 19);
+        static constexpr uint64_t pwm_pins = an_pin_bits(3, 5, 6, 9, 10, 11);
+        static constexpr uint64_t interrupt_pins = an_pin_bits(2, 3);
+        static constexpr uint8_t adc_bits = 10;
+};
+/* A6 and A7 are inputs of the ADC only */
+struct an_board_nano : an_board_uno {
+        static constexpr const char* name = "Arduino Nano";
+        static constexpr uint8_t pin_count = 22;
+        static constexpr uint64_t analog_pins = an_pin_range(14, 21);
+};
+struct an_board_pro : an_board_nano {
+        static constexpr const char* name = "Arduino Pro";
+};
+/* Every digital pin of the Teensy 4.1 can interrupt */
+struct an_board_teensy_41 {
+        static constexpr const char* name = "Teensy 4.1";
+        static constexpr uint8_t pin_count = 42;
+        static constexpr uint64_t analog_pins = an_pin_range(14, 27) | an_pin_range(38, 41);
+        static constexpr uint64_t pwm_pins = an_pin_range(0, 15) | an_pin_bits(18, 19, 28, 29, 33, 36, 37) | an_pin_range(22, 25);
+        static constexpr uint64_t interrupt_pins = an_pin_range(0, 41);
+        static constexpr uint8_t adc_bits = 12;
+};
+
 /* BOARD DEFINITIONS */
 #ifdef AN_BOARD_PRO_MINI
 #define AN_BOARD_PRO
@@ -70,7 +323,7 @@ typedef enum {
 
 #if defined(AN_TEENSY_41)
 
-#define AN_MAX_PINS 42
+typedef an_board_teensy_41 an_board_traits;
 
 enum {
         LED_BUILTIN = 13,
@@ -98,7 +351,11 @@ enum {
 /* ↓ Arduino PRO / Pro Mini and Arduino NANO ↓ */
 #elif defined(AN_BOARD_NANO) || defined(AN_BOARD_PRO)
 
-#define AN_MAX_PINS 21
+#ifdef AN_BOARD_NANO
+typedef an_board_nano an_board_traits;
+#else
+typedef an_board_pro an_board_traits;
+#endif
 
 enum {
         LED_BUILTIN = 13,
@@ -116,7 +373,7 @@ enum {
 #else // Default is Arduino Uno
 /* ↓ Arduino UNO ↓ */
 
-#define AN_MAX_PINS 19
+typedef an_board_uno an_board_traits;
 
 enum {
         LED_BUILTIN = 13,
@@ -132,19 +389,292 @@ enum {
 #endif
 
 #define AREF 255
-float an_pin_voltage[AN_MAX_PINS] = {0};
+#define AN_MAX_PINS an_board_traits::pin_count
+#define AN_BOARD_NAME an_board_traits::name
+
+/* Capabilities of every pin number as bits of an_pin_types_t, so checking a pin
+ * at runtime is one lookup. AREF has none, it isn't a pin of the bank and only
+ * an_set_voltage() takes it. Interrupt numbers count the interrupt pins from the
+ * lowest like the core does, interrupt 0 is pin 2 on the Uno, and -1 is none. */
+template <typename traits>
+struct an_pin_caps_table {
+        uint8_t caps[256] = {};
+        int8_t int_of_pin[256] = {};
+        int8_t pin_of_int[256] = {};
+        constexpr an_pin_caps_table()
+        {
+                for (unsigned i = 0; i < 256; i++)
+                        int_of_pin[i] = pin_of_int[i] = -1;
+                int8_t ints = 0;
+                for (unsigned pin = 0; pin < traits::pin_count; pin++) {
+                        caps[pin] = 1 << an_digital | (traits::analog_pins >> pin & 1) << an_analog |
+                                (traits::pwm_pins >> pin & 1) << an_pwm | (traits::interrupt_pins >> pin & 1) << an_int_pin;
+                        if (traits::interrupt_pins >> pin & 1) {
+                                int_of_pin[pin] = ints;
+                                pin_of_int[ints++] = (int8_t)pin;
+                        }
+                }
+        }
+        constexpr bool has(const uint8_t pin, const an_pin_types_t type) const {return caps[pin] >> type & 1;}
+};
+inline constexpr an_pin_caps_table<an_board_traits> an_pin_caps{};
+static_assert(AN_MAX_PINS <= 64, "pin masks hold one bit per pin");
+
+#ifndef AN_TEENSY_41
+/* PORTS */
+/* The ports of the ATmega328P: PORTB holds pins 8-13, PORTC A0-A5 and PORTD pins 0-7 */
+typedef enum {AN_PORTB, AN_PORTC, AN_PORTD, AN_PORT_COUNT} an_port_t;
+typedef enum {AN_REG_PORT, AN_REG_DDR, AN_REG_PIN} an_port_reg_t;
+constexpr uint8_t an_port_first_pin[AN_PORT_COUNT] = {8, 14, 0};
+constexpr uint8_t an_port_width[AN_PORT_COUNT] = {6, 6, 8};
+// bits of a port that are connected to pins of the board
+constexpr uint8_t an_port_mask(const an_port_t port)
+{
+        return ((1u << an_port_width[port]) - 1) & ((1ULL << (AN_MAX_PINS - an_port_first_pin[port])) - 1);
+}
+// port a pin belongs to, AN_PORT_COUNT if it isn't on one
+constexpr an_port_t an_port_of(const uint8_t pin)
+{
+        return pin < 8 ? AN_PORTD : pin < 14 ? AN_PORTB : pin < 20 ? AN_PORTC : AN_PORT_COUNT;
+}
+enum {PB0, PB1, PB2, PB3, PB4, PB5, PB6, PB7};
+enum {PC0, PC1, PC2, PC3, PC4, PC5, PC6};
+enum {PD0, PD1, PD2, PD3, PD4, PD5, PD6, PD7};
+enum {PORTB0, PORTB1, PORTB2, PORTB3, PORTB4, PORTB5, PORTB6, PORTB7};
+enum {PORTC0, PORTC1, PORTC2, PORTC3, PORTC4, PORTC5, PORTC6};
+enum {PORTD0, PORTD1, PORTD2, PORTD3, PORTD4, PORTD5, PORTD6, PORTD7};
+enum {DDB0, DDB1, DDB2, DDB3, DDB4, DDB5, DDB6, DDB7};
+enum {DDC0, DDC1, DDC2, DDC3, DDC4, DDC5, DDC6};
+enum {DDD0, DDD1, DDD2, DDD3, DDD4, DDD5, DDD6, DDD7};
+enum {PINB0, PINB1, PINB2, PINB3, PINB4, PINB5, PINB6, PINB7};
+enum {PINC0, PINC1, PINC2, PINC3, PINC4, PINC5, PINC6};
+enum {PIND0, PIND1, PIND2, PIND3, PIND4, PIND5, PIND6, PIND7};
+#endif
+
+/* ESTIMATION */
+/* Cycles the target spends in each API call, loop is the overhead of main()
+ * between loop() iterations and serial_byte the CPU time to queue one byte */
+typedef struct an_cycle_costs {
+        uint32_t digital_write;
+        uint32_t digital_read;
+        uint32_t pin_mode;
+        uint32_t analog_write;
+        uint32_t analog_read;
+        uint32_t millis;
+        uint32_t serial_byte;
+        uint32_t isr_entry;
+        uint32_t loop;
+        uint32_t port_io;
+} an_cycle_costs_t;
+#if defined(AN_TEENSY_41)
+#ifndef AN_CPU_HZ
+#define AN_CPU_HZ 600000000
+#endif
+#ifndef AN_CYCLE_COSTS
+#define AN_CYCLE_COSTS {30, 25, 60, 120, 10000, 10, 100, 50, 20, 2}
+#endif
+#else
+#ifndef AN_CPU_HZ
+#define AN_CPU_HZ 16000000
+#endif
+/* analogRead() is 13 ADC clocks with the ADC clock at F_CPU / 128, PORTB |= _BV(5) is a 2 cycle sbi */
+#ifndef AN_CYCLE_COSTS
+#define AN_CYCLE_COSTS {56, 50, 60, 100, 1720, 40, 70, 90, 10, 2}
+#endif
+#endif
+// bytes the UART transmit buffer holds before Serial.print() has to wait
+#ifndef AN_ESTIMATE_TX_BUFFER
+#define AN_ESTIMATE_TX_BUFFER 64
+#endif
+// predicted loop() periods longer than this count as deadline misses, 0 disables
+#ifndef AN_ESTIMATE_DEADLINE_US
+#define AN_ESTIMATE_DEADLINE_US 0
+#endif
+typedef struct an_estimate {
+        unsigned long long target_us;
+        unsigned long long loops;
+        double loop_mean_us;
+        double loop_min_us;
+        double loop_max_us;
+        unsigned long long isr_count;
+        double isr_mean_us;
+        double isr_max_us;
+        unsigned long long deadline_misses;
+} an_estimate_t;
+#ifdef AN_ESTIMATE
+#define an_estimate_cost(cost) an_estimate_add(an_board_local->costs.cost)
+void an_estimate_add(const uint64_t cycles);
+void an_estimate_serial(uint64_t& tx_done, const unsigned long baud, const size_t len);
+void an_estimate_wait(const uint64_t until);
+#else
+#define an_estimate_cost(cost)
+#endif
+
+/* SHARED MEMORY LAYOUT */
+#define AN_SHM_VERSION 1
+#define AN_SHM_PINS 64
+/* Version 1 of the segment published with AN_SHM, in native byte order. Every
+ * change increments begin before and end after it, possibly from several
+ * threads at once. A reader waits for end to equal begin, copies what it needs
+ * and starts over if begin has moved since. Later versions only append fields,
+ * so a reader checks magic, takes version and size from the header and ignores
+ * what lies past the fields it knows. */
+typedef struct an_shm {
+        char magic[8];                              // "ANSHM" padded with zeroes
+        uint32_t version;                           // AN_SHM_VERSION
+        uint32_t size;                              // sizeof(an_shm_t) of the writer
+        uint32_t pin_count;                         // pins of the board, entries past it stay 0
+        uint32_t pid;                               // process of the sketch
+        char board[32];                             // AN_BOARD_NAME
+        std::atomic<uint64_t> begin;
+        std::atomic<uint64_t> end;
+        std::atomic<uint64_t> time_us;              // board time of the last change
+        std::atomic<float> reference_v;             // analog reference in volts
+        uint32_t reserved;
+        std::atomic<float> voltage[AN_SHM_PINS];    // volts
+        std::atomic<uint8_t> mode[AN_SHM_PINS];     // INPUT 0, OUTPUT 1, INPUT_PULLUP 2
+        std::atomic<uint64_t> toggles[AN_SHM_PINS]; // level changes since the export started
+} an_shm_t;
+static_assert(offsetof(an_shm_t, begin) == 56 && offsetof(an_shm_t, voltage) == 88 &&
+              offsetof(an_shm_t, mode) == 344 && offsetof(an_shm_t, toggles) == 408 && sizeof(an_shm_t) == 920,
+              "the shared memory layout is fixed, bump AN_SHM_VERSION and append to change it");
+static_assert(AN_MAX_PINS <= AN_SHM_PINS, "every pin needs an entry in the shared memory segment");
+
+/* PIN BANK */
+typedef struct an_pin_snapshot {
+        float voltage[AN_MAX_PINS];
+} an_pin_snapshot_t;
+
+/* Every pin is an atomic on its own cache line, so generator threads writing
+ * different pins don't share lines. Writers bump begin before and end after a
+ * store, readers wanting all pins at once retry until no write overlapped them. */
+class an_pin_bank
+{
+private:
+        struct alignas(64) an_pin_slot {
+                std::atomic<float> voltage{0.0f};
+        };
+        an_pin_slot pins[AN_MAX_PINS];
+        alignas(64) std::atomic<unsigned> begin{0};
+        alignas(64) std::atomic<unsigned> end{0};
+        /* Write sections the calling thread has open. A component or ISR run from
+         * inside one, like during shiftOut(), can take a snapshot without waiting
+         * for its own thread to finish the write. A thread works on one board at a time. */
+        inline static thread_local const an_pin_bank* own_bank = nullptr;
+        inline static thread_local unsigned own_sections = 0;
+public:
+        inline float get(const uint8_t pin) const {return pins[pin].voltage.load(std::memory_order_acquire);}
+        inline float exchange(const uint8_t pin, const float voltage)
+        {
+                begin.fetch_add(1);
+                float old = pins[pin].voltage.exchange(voltage);
+                end.fetch_add(1);
+                return old;
+        }
+        /* Stores between begin_write() and end_write() look like a single write to
+         * snapshot(), so a port byte or a shiftOut() is only counted once */
+        inline void begin_write()
+        {
+                own_bank = this;
+                own_sections++;
+                begin.fetch_add(1);
+        }
+        inline void end_write()
+        {
+                end.fetch_add(1);
+                own_sections--;
+        }
+        // every pin back to 0V, as one write
+        inline void reset()
+        {
+                begin_write();
+                for (auto& pin : pins)
+                        pin.voltage.store(0.0f, std::memory_order_relaxed);
+                end_write();
+        }
+        /* Drives every pin in mask to 5V or 0V inside an open write section. The old
+         * voltages go to old, and the pins that were high are returned as a mask. */
+        inline uint64_t drive(uint64_t mask, const uint64_t levels, float* old)
+        {
+                uint64_t was_high = 0;
+                while (mask) {
+                        uint8_t pin = __builtin_ctzll(mask);
+                        mask &= mask - 1;
+                        old[pin] = pins[pin].voltage.exchange(levels >> pin & 1 ? 5.0f : 0.0f);
+                        was_high |= (uint64_t)(old[pin] > 3) << pin;
+                }
+                return was_high;
+        }
+        // mask of the pins in mask that are high
+        inline uint64_t levels(uint64_t mask) const
+        {
+                uint64_t high = 0;
+                while (mask) {
+                        uint8_t pin = __builtin_ctzll(mask);
+                        mask &= mask - 1;
+                        high |= (uint64_t)(get(pin) > 3) << pin;
+                }
+                return high;
+        }
+        an_pin_snapshot_t snapshot() const
+        {
+                an_pin_snapshot_t snap;
+                /* sections of the calling thread stay open while it reads */
+                const unsigned own = own_bank == this ? own_sections : 0;
+                for (;;) {
+                        unsigned seq = begin.load(std::memory_order_acquire);
+                        if (seq - end.load(std::memory_order_acquire) != own)
+                                continue;
+                        for (unsigned i = 0; i < AN_MAX_PINS; i++)
+                                snap.voltage[i] = pins[i].voltage.load(std::memory_order_relaxed);
+                        std::atomic_thread_fence(std::memory_order_acquire);
+                        if (begin.load(std::memory_order_relaxed) == seq)
+                                return snap;
+                }
+        }
+};
 
 
 /* FUNCTION DEFINITIONS */
 
 // non-arduino functions
 void an_set_voltage(const uint8_t pin, const float voltage);
+an_pin_snapshot_t an_snapshot_pins();
+#ifdef AN_TRACE
+void an_trace_push(const an_trace_type_t type, const uint8_t pin, const float old_value, const float new_value);
+#endif
+bool an_trace_export_vcd(const char* trace_path, const char* vcd_path);
 void an_request_voltage(const uint8_t pin);
+/* Waits up to timeout microseconds (0 waits forever) for an edge on pin, mode is RISING, FALLING
+ * or CHANGE, LOW and HIGH return at once if the pin already has the level. Returns false on timeout,
+ * when is set to the time of the edge in microseconds since start. */
+bool an_wait_for_edge(const uint8_t pin, const an_int_mode_t mode, const unsigned long timeout = 0, unsigned long long* when = nullptr);
 inline void an_print_timestamp();
 void an_attach_sine(const uint8_t pin, const unsigned hz = 1, const float amp = 2.5, const float dc = 2.5, const bool abs = false);
 void an_remove_sine(const uint8_t pin);
 void an_attach_square(const uint8_t pin, const unsigned hz = 1, const float duty = 0.5);
 void an_remove_square(const uint8_t pin);
+/* One period of a waveform in volts, played one sample after the other */
+typedef std::vector<float> an_waveform_t;
+an_waveform_t an_wave_sine(const size_t samples = AN_WAVE_SAMPLES, const float amp = 2.5, const float dc = 2.5);
+an_waveform_t an_wave_triangle(const size_t samples = AN_WAVE_SAMPLES, const float amp = 2.5, const float dc = 2.5);
+an_waveform_t an_wave_saw(const size_t samples = AN_WAVE_SAMPLES, const float amp = 2.5, const float dc = 2.5);
+an_waveform_t an_wave_pwm(const size_t samples = AN_WAVE_SAMPLES, const float duty = 0.5, const float high = 5.0);
+an_waveform_t an_wave_noise(const size_t samples = AN_WAVE_SAMPLES, const float amp = 2.5, const float dc = 2.5, const uint32_t seed = 1);
+/* Plays table on pin at rate samples per second, so the waveform repeats at rate / table.size() Hz */
+void an_attach_waveform(const uint8_t pin, const an_waveform_t& table, const double rate);
+void an_remove_waveform(const uint8_t pin);
+/* How late the samples of a waveform reached the pin compared to when they were due */
+typedef struct an_jitter {
+        unsigned long long samples;
+        double mean_ns, stddev_ns, max_ns;
+} an_jitter_t;
+an_jitter_t an_waveform_jitter(const uint8_t pin);
+int an_play_stimulus(const char* path, const double time_scale = 1000000.0);
+void an_stop_stimulus(const int id);
+#ifdef AN_VIRTUAL_TIME
+void an_advance_time(const unsigned long long microseconds);
+#endif
 
 // Digital I/O
 bool digitalRead(const uint8_t pin);
@@ -156,13 +686,64 @@ uint16_t analogRead(const uint8_t pin);
 void analogReference(an_reference_t type);
 void analogWrite(const uint8_t pin, const uint8_t value);
 
+#ifdef AN_TEENSY_41
+// bits analogRead() returns, the converter has 12 and other values are scaled like on the Teensy
+void analogReadResolution(const unsigned bits);
+#endif
+/* Takes n samples of pin into buf, rate samples per second apart starting now. A rate
+ * of 0 or one faster than the conversion time allows runs the ADC free, one conversion
+ * after the other. Generators and stimuli keep running between the samples. */
+void an_analog_read_block(const uint8_t pin, uint16_t* buf, const size_t n, const double rate = 0);
+// adds gaussian noise of lsb_rms steps of the converter to every conversion of the current board
+void an_adc_noise(const float lsb_rms, const uint64_t seed = 1);
+
+/* The calls above without the check of the pin, used by the templated calls below */
+bool an_digital_read(const uint8_t pin);
+void an_digital_write(const uint8_t pin, const bool value);
+void an_pin_mode(const uint8_t pin, const an_pin_mode_t mode);
+uint16_t an_analog_read(const uint8_t pin);
+void an_analog_write(const uint8_t pin, const uint8_t value);
+/* The pin is checked against the board at compile time, digitalWrite<LED_BUILTIN>(HIGH) */
+template <uint8_t pin>
+inline bool digitalRead()
+{
+        static_assert(an_pin_caps.has(pin, an_digital), "pin is not defined on this board");
+        return an_digital_read(pin);
+}
+template <uint8_t pin>
+inline void digitalWrite(const bool value)
+{
+        static_assert(an_pin_caps.has(pin, an_digital), "pin is not defined on this board");
+        an_digital_write(pin, value);
+}
+template <uint8_t pin>
+inline void pinMode(const an_pin_mode_t mode)
+{
+        static_assert(an_pin_caps.has(pin, an_digital), "pin is not defined on this board");
+        an_pin_mode(pin, mode);
+}
+template <uint8_t pin>
+inline uint16_t analogRead()
+{
+        static_assert(an_pin_caps.has(pin, an_analog), "pin is not an analog input on this board");
+        return an_analog_read(pin);
+}
+template <uint8_t pin>
+inline void analogWrite(const uint8_t value)
+{
+        static_assert(an_pin_caps.has(pin, an_pwm), "pin has no PWM on this board");
+        an_analog_write(pin, value);
+}
+
 // Advanced I/O
 void noTone(const uint8_t pin);
-unsigned long pulseIn(const uint8_t pin, const bool val, const unsigned long timeout);
-unsigned long pulseInLong(const uint8_t pin, const bool val, const unsigned long timeout);
+unsigned long pulseIn(const uint8_t pin, const bool val, const unsigned long timeout = 1000000);
+unsigned long pulseInLong(const uint8_t pin, const bool val, const unsigned long timeout = 1000000);
 uint8_t shiftIn(const uint8_t data_pin, const uint8_t clock_pin, const bool bit_order);
 void shiftOut(const uint8_t data_pin, const uint8_t clock_pin, const bool bit_order, const byte value);
 void tone(const uint8_t pin, unsigned hz, unsigned long dur = 0);
+// writes the tones of the current board to a WAV file or a named pipe, nullptr closes it
+bool an_tone_output(const char* path);
 
 //Time
 inline void delay(const unsigned long milliseconds);
@@ -205,636 +786,4953 @@ inline void randomSeed(unsigned long seed);
 #define bitClear(value, bit) ((value) &= ~(1UL << (bit)))
 #define bitToggle(value, bit) ((value) ^= (1UL << (bit)))
 #define bitWrite(value, bit, bitvalue) ((bitvalue) ? bitSet(value, bit) : bitClear(value, bit))
+#define _BV(bit) (1 << (bit))
+#define bit_is_set(sfr, bit) ((sfr) & _BV(bit))
+#define bit_is_clear(sfr, bit) (!((sfr) & _BV(bit)))
 #define highByte(w) ((uint8_t) ((w) >> 8))
 #define lowByte(w) ((uint8_t) ((w) & 0xff))
 
 // Interrupts
-#define digitalPinToInterrupt(pin) (pin)
-void attachInterrupt(const uint8_t pin, void(*intpointer)(void), const an_int_mode_t mode);
-void  detachInterrupt(const uint8_t pin);
+#define NOT_AN_INTERRUPT -1
+#define digitalPinToInterrupt(pin) (an_pin_caps.int_of_pin[(uint8_t)(pin)])
+/* Both take interrupt numbers like the core, attaching one the board doesn't
+ * have prints a warning and does nothing */
+void attachInterrupt(const uint8_t interrupt, void(*intpointer)(void), const int mode);
+void  detachInterrupt(const uint8_t interrupt);
 inline void interrupts(void);
 inline void noInterrupts(void);
+typedef struct an_isr_latency {
+        unsigned long count;
+        unsigned long long total_us;
+        unsigned long long max_us;
+} an_isr_latency_t;
+// time between an edge and the start of its ISR, for ISRs raised so far
+an_isr_latency_t an_isr_latency();
+
+/* NUMBER FORMATTING */
+// longest text an_format() writes, a result of 0 means it didn't fit
+#define AN_FMT_MAX 72
+
+// formats like std::ostream does by default
+template <typename T>
+inline size_t an_format(char* buf, const T val)
+{
+        std::to_chars_result res;
+        if constexpr (std::is_floating_point<T>::value)
+                res = std::to_chars(buf, buf + AN_FMT_MAX, val, std::chars_format::general, 6);
+        else
+                res = std::to_chars(buf, buf + AN_FMT_MAX, val);
+        return res.ec == std::errc() ? res.ptr - buf : 0;
+}
+template <typename T>
+inline size_t an_format(char* buf, const T val, const an_num_fmt_t fmt)
+{
+        if (fmt == BIN) {
+                for (size_t i = 0; i < sizeof(val) * 8; i++)
+                        buf[i] = (val >> (sizeof(val) * 8 - 1 - i)) & 1 ? '1' : '0';
+                return sizeof(val) * 8;
+        }
+        std::to_chars_result res;
+        if (fmt == DEC)
+                res = std::to_chars(buf, buf + AN_FMT_MAX, (long)val);
+        else
+                res = std::to_chars(buf, buf + AN_FMT_MAX, (unsigned long)(long)val, fmt == HEX ? 16 : 8);
+        return res.ec == std::errc() ? res.ptr - buf : 0;
+}
+inline size_t an_format(char* buf, const double val, const uint8_t decimals)
+{
+        std::to_chars_result res = std::to_chars(buf, buf + AN_FMT_MAX, val, std::chars_format::fixed, decimals);
+        return res.ec == std::errc() ? res.ptr - buf : 0;
+}
 
+/* STRINGS */
+#ifdef AN_STRING_HEAP
+// heap bytes held by the Strings of the current board
+std::atomic<size_t>& an_string_heap();
+#endif
+
+/* Numbers are formatted with an_format() and parsed with from_chars, without
+ * going through streams. With AN_STRING_HEAP Strings draw from a heap of that
+ * many bytes per board and fail like on an AVR when it runs out: the String
+ * is left unchanged, or empty when it is constructed or assigned. */
 class String : public std::string {
-public:
-        String() {};
-        template<typename T>
-        String(const T val)
+private:
+#ifdef AN_STRING_HEAP
+        /* like an AVR String the buffer is length + 1 bytes and never shrinks */
+        size_t heap = 0;
+        std::atomic<size_t>* heap_owner = &an_string_heap();
+#endif
+        inline bool an_alloc(const size_t len)
+        {
+#ifdef AN_STRING_HEAP
+                if (len + 1 <= heap)
+                        return true;
+                size_t need = len + 1 - heap;
+                size_t used = heap_owner->load(std::memory_order_relaxed);
+                do {
+                        if (used + need > AN_STRING_HEAP)
+                                return false;
+                } while (!heap_owner->compare_exchange_weak(used, used + need));
+                heap += need;
+#endif
+                return true;
+        }
+        inline void an_free()
+        {
+#ifdef AN_STRING_HEAP
+                heap_owner->fetch_sub(heap);
+                heap = 0;
+#endif
+        }
+        inline bool an_append(const char* data, const size_t len)
         {
-                std::stringstream s;
-                s << val;
-                append(s.str());
+                if (!an_alloc(length() + len))
+                        return false;
+                append(data, len);
+                return true;
+        }
+        template <typename T>
+        bool an_append_value(const T& val)
+        {
+                if constexpr (std::is_convertible<T, const char*>::value) {
+                        const char* str = val;
+                        return an_append(str, str ? strlen(str) : 0);
+                } else if constexpr (std::is_convertible<T, std::string_view>::value) {
+                        std::string_view str = val;
+                        return an_append(str.data(), str.length());
+                } else if constexpr (std::is_same<T, char>::value || std::is_same<T, unsigned char>::value ||
+                                     std::is_same<T, signed char>::value) {
+                        char c = val;
+                        return an_append(&c, 1);
+                } else if constexpr (std::is_same<T, bool>::value) {
+                        return an_append(val ? "1" : "0", 1);
+                } else if constexpr (std::is_arithmetic<T>::value) {
+                        char buf[AN_FMT_MAX];
+                        return an_append(buf, an_format(buf, val));
+                } else {
+                        std::stringstream s;
+                        s << val;
+                        std::string str = s.str();
+                        return an_append(str.data(), str.length());
+                }
+        }
+        static inline int an_index(const size_t pos) {return pos == npos ? -1 : (int)pos;}
+        template <typename T>
+        static inline T an_parse(const char* str, const char* end)
+        {
+                while (str < end && isspace((unsigned char)*str))
+                        str++;
+                if (str < end && *str == '+')
+                        str++;
+                T res = 0;
+                std::from_chars(str, end, res);
+                return res;
         }
+public:
+        String() {}
+        template <typename T>
+        String(const T& val) {an_append_value(val);}
         template <typename T>
         String(const T val, const an_num_fmt_t fmt)
         {
-                std::stringstream s = {};
-                switch (fmt) {
-                case BIN: {
-                        std::bitset<sizeof(val) * 8> bits(val);
-                        s << bits;
-                        append(s.str());
-                        return;
-                } case DEC: {
-                        break;
-                } case HEX: {
-                        s << std::hex;
-                        break;
-                } case OCT: {
-                        s << std::oct;
-                        break;
-                }}
-                s << (long)val;
-                append(s.str());
+                char buf[AN_FMT_MAX];
+                if constexpr (std::is_integral<T>::value)
+                        an_append(buf, an_format(buf, val, fmt));
+                else
+                        an_append(buf, an_format(buf, (long)val, fmt));
         }
         String(const char* buff, const an_num_fmt_t fmt)
         {
-                for (unsigned int i = 0; i < strlen(buff); i++)
-                        append(String((uint8_t)buff[i], fmt));
+                char buf[AN_FMT_MAX];
+                for (; *buff; buff++)
+                        an_append(buf, an_format(buf, (uint8_t)*buff, fmt));
         }
         String(const double val, const uint8_t decimals)
         {
-                std::stringstream s;
-                s << std::fixed << std::setprecision(decimals) << val;
-                append(s.str());
+                char buf[AN_FMT_MAX];
+                an_append(buf, an_format(buf, val, decimals));
         }
-        inline float toFloat() {return std::stof(c_str());}
-        inline int toInt() {return (int)toFloat();}
-        inline double toDouble() {return std::atof(c_str());}
-
-        inline void getBytes(byte* buf, unsigned len) {strncpy((char*)buf, substr(0, len).c_str(), len);}
-        inline void toCharArray(unsigned char* buf, const unsigned len) {getBytes((byte*)buf, len); buf[len] = '\0';}
-        inline String substring(size_t pos = 0, size_t len = npos) {return substr(pos, len);}
-        inline void toLowerCase()
+#ifdef AN_STRING_HEAP
+        String(const String& other) : std::string() {an_append(other.data(), other.length());}
+        String(String&& other) noexcept : std::string(std::move(other)), heap(other.heap), heap_owner(other.heap_owner)
         {
-                std::transform(begin(), end(), begin(),
-                        [](char c){return std::tolower(c);});
+                other.heap = 0;
         }
-        inline void toUpperCase()
+        String& operator=(const String& other)
+        {
+                if (this == &other)
+                        return *this;
+                if (!an_alloc(other.length())) {
+                        clear();
+                        return *this;
+                }
+                assign(other);
+                return *this;
+        }
+        String& operator=(String&& other) noexcept
         {
-                std::transform(begin(), end(), begin(),
-                        [](char c){return std::toupper(c);});
+                if (this == &other)
+                        return *this;
+                an_free();
+                std::string::swap(other);
+                other.clear();
+                heap = other.heap;
+                heap_owner = other.heap_owner;
+                other.heap = 0;
+                return *this;
         }
-        inline char charAt(const unsigned int n) {return at(n);}
-        inline int compareTo(const String str2) {return compare(str2);}
+        ~String() {an_free();}
+#else
+        String(const String& other) = default;
+        String(String&& other) noexcept = default;
+        String& operator=(const String& other) = default;
+        String& operator=(String&& other) noexcept = default;
+#endif
         template <typename T>
-        inline bool concat(const T val) {append(String(val)); return true;}
-        inline bool startsWith(const String substr) {return rfind(substr, 0) == 0;}
-        inline bool endsWith(const String str) {return compare(length() - str.length(), str.length(), str) == 0;}
-        inline bool equals(const String str2) {return compare(str2) == 0;}
-        bool equalsIgnoreCase(const String str2)
-        {
-                String strlwr = String(c_str());
-                String str2lwr = String(str2.c_str());
-                strlwr.toLowerCase();
-                str2lwr.toLowerCase();
-                return strlwr.compare(str2lwr) == 0;
-        }
-        inline size_t indexOf(const char* val, const size_t from = 0) {return find(val, from);}
-        inline size_t lastIndexOf(const char* val, const size_t from = 0) {return rfind(val, from);}
-        inline void remove(const size_t index, const size_t count = 1) {erase(index, count);}
-        void replace(const String from, const String to)
-        {
-                size_t start_pos = 0;
-                while ((start_pos = find(from, start_pos)) != npos) {
-                        std::string::replace(start_pos, from.length(), to);
-                        start_pos += to.length();
-                }
-        }
-        inline void setCharAt(const size_t index, const char c) {at(index) = c;}
-        void trim()
+        String& operator=(const T& val)
         {
-                erase(begin(), std::find_if(begin(), end(), [](char ch) {
-                        return !std::isspace(ch);
-                }));
-                erase(std::find_if(rbegin(), rend(), [](char ch) {
-                        return !std::isspace(ch);
-                }).base(), end());
+                clear();
+                an_append_value(val);
+                return *this;
+        }
+        template <typename T>
+        inline String& operator+=(const T& val) {an_append_value(val); return *this;}
+        template <typename T>
+        inline bool concat(const T& val) {return an_append_value(val);}
+        // like Arduino returns 1 on success and 0 when the heap can't hold size characters
+        inline unsigned char reserve(const size_t size)
+        {
+                if (!an_alloc(size))
+                        return 0;
+                std::string::reserve(size);
+                return 1;
         }
-};
 
-#ifndef _WIN32
-void serialEvent() __attribute__((weak));
-#endif
+        inline long toInt() const {return an_parse<long>(data(), data() + length());}
+        inline float toFloat() const {return an_parse<float>(data(), data() + length());}
+        inline double toDouble() const {return an_parse<double>(data(), data() + length());}
 
-class an_serial
-{
-private:
-        String buffer;
-        inline bool skip_alpha(LookaheadMode lookahead, bool is_float, char ignore)
+        /* copies at most bufsize - 1 characters from index and terminates buf */
+        void getBytes(unsigned char* buf, const size_t bufsize, const size_t index = 0) const
         {
-                while(available()) {
-                        char c = peek();
-                        if (c == ignore){
-                                buffer.erase(buffer.begin());
-                                continue;
-                        }
-                        if ((c == '-') || (c >= '0' && c <= '9') ||
-                            (is_float && c == '.'))
-                                return true;
-                        switch (lookahead) {
-                        case SKIP_ALL:
-                                buffer.erase(buffer.begin());
-                                break;
-                        case SKIP_NONE:
-                        case SKIP_WHITESPACE:
-                               return true;
-                        }
-                }
-                return false;
-         }
-        inline void remove_digit(bool is_float)
-        {
-                while(available()) {
-                        char c = peek();
-                        if ((c == '-') || (c >= '0' && c <= '9') ||
-                            (is_float && c == '.'))
-                                buffer.erase(buffer.begin());
-                        else
-                                return;
-                }
+                if (!bufsize || !buf)
+                        return;
+                size_t n = index < length() ? length() - index : 0;
+                if (n > bufsize - 1)
+                        n = bufsize - 1;
+                memcpy(buf, data() + index, n);
+                buf[n] = '\0';
         }
-public:
-        inline size_t available() {return buffer.length();}
-        inline size_t availableForWrite() {return SIZE_MAX;}
-        inline void begin(unsigned speed) {}
-        inline void begin(unsigned speed, int config) {}
-        inline void end() {}
-        inline void flush() {std::cout << std::flush;}
-        inline void setTimeout(const long new_time) {}
-        inline String readString() {String str = buffer; buffer.clear(); return str;}
-        inline String readStringUntil(const char terminator)
-        {
-                size_t t_pos = buffer.find(terminator);
-                if (t_pos == std::string::npos)
-                        return readString();
-
-                std::string str = buffer;
-                buffer.erase(0, t_pos);
-                str.erase(str.begin() + t_pos, str.end());
-                return str;
+        inline void toCharArray(char* buf, const size_t bufsize, const size_t index = 0) const
+        {
+                getBytes((unsigned char*)buf, bufsize, index);
         }
-        void an_take_input()
+        inline void toCharArray(unsigned char* buf, const size_t bufsize, const size_t index = 0) const
         {
-                std::cout << "ArduinoNative is requesting Serial input: ";
-                std::cin >> buffer;
-#ifndef _WIN32
-                if (serialEvent)
-                        serialEvent();
-#endif
+                getBytes(buf, bufsize, index);
         }
-        uint8_t peek() {return buffer.length() > 0 ? uint8_t(buffer.c_str()[0]) : 0;}
-        inline uint8_t read()
+        // characters from left up to but not including right, like Arduino
+        String substring(size_t left, size_t right = npos) const
         {
-                uint8_t read_byte = peek();
-                buffer.erase(buffer.begin());
-                return read_byte;
+                if (left > right)
+                        std::swap(left, right);
+                if (left >= length())
+                        return String();
+                if (right > length())
+                        right = length();
+                return String(std::string_view(data() + left, right - left));
         }
-        size_t readBytes(char* buffer, const unsigned length, const bool is_until = false, const char terminator = '\0')
+        inline void toLowerCase()
         {
-                size_t count = 0;
-                for(; count < length; count++) {
-                        uint8_t c = read();
-                        if (c < 0 || (is_until && c == terminator))
-                                break;
-                        *buffer++ = c;
-                }
-                return count;
+                for (char& c : *this)
+                        c = tolower((unsigned char)c);
         }
-        inline size_t readBytesUntil(const char terminator, char* buffer, const unsigned length)
+        inline void toUpperCase()
         {
-                return readBytes(buffer, length, true, terminator);
+                for (char& c : *this)
+                        c = toupper((unsigned char)c);
         }
-        bool find(const char* target, const size_t len = 1)
+        inline char charAt(const size_t n) const {return n < length() ? (*this)[n] : 0;}
+        inline void setCharAt(const size_t index, const char c)
         {
-                size_t t_pos = buffer.find(target);
-                if (t_pos == std::string::npos) {
-                        buffer.clear();
+                if (index < length())
+                        (*this)[index] = c;
+        }
+        inline int compareTo(const std::string_view str) const {return compare(str);}
+        inline bool equals(const std::string_view str) const {return compare(str) == 0;}
+        bool equalsIgnoreCase(const std::string_view str) const
+        {
+                if (str.length() != length())
                         return false;
-                }
-                buffer.erase(0, t_pos);
+                for (size_t i = 0; i < length(); i++)
+                        if (tolower((unsigned char)(*this)[i]) != tolower((unsigned char)str[i]))
+                                return false;
                 return true;
         }
-        bool findUntil(const char* target, const char* terminal)
+        inline bool startsWith(const std::string_view str, const size_t offset = 0) const
         {
-                bool res = find(target);
-                if (res)
-                        find(terminal);
-                return res;
+                return offset <= length() && length() - offset >= str.length() && compare(offset, str.length(), str) == 0;
         }
-        int parseInt(const LookaheadMode lookahead = SKIP_ALL, const char ignore = '\n')
+        inline bool endsWith(const std::string_view str) const
         {
-                if (!skip_alpha(lookahead, false, ignore))
-                        return 0;
-                int res = buffer.toInt();
-                remove_digit(false);
-                return res;
+                return length() >= str.length() && compare(length() - str.length(), str.length(), str) == 0;
         }
-        float parseFloat(const LookaheadMode lookahead = SKIP_ALL, const char ignore = '\n')
+        inline int indexOf(const char c, const size_t from = 0) const {return an_index(find(c, from));}
+        inline int indexOf(const std::string_view str, const size_t from = 0) const {return an_index(find(str, from));}
+        inline int lastIndexOf(const char c, const size_t from = npos) const {return an_index(rfind(c, from));}
+        inline int lastIndexOf(const std::string_view str, const size_t from = npos) const {return an_index(rfind(str, from));}
+        // removes count characters from index, or everything after it
+        inline void remove(const size_t index, const size_t count = npos)
         {
-                if (!skip_alpha(lookahead, true, ignore))
-                        return 0.0f;
-                float res = buffer.toFloat();
-                remove_digit(true);
-                return res;
+                if (index < length())
+                        erase(index, count);
         }
-        template <typename T> inline size_t print(const T val)
+        inline void replace(const char from, const char to)
         {
-                String s = val;
-                std::cout << s;
-                return s.length();
+                for (char& c : *this)
+                        if (c == from)
+                                c = to;
+        }
+        void replace(const std::string_view from, const std::string_view to)
+        {
+                if (from.empty())
+                        return;
+                if (to.length() > from.length()) {
+                        size_t count = 0;
+                        for (size_t pos = 0; (pos = find(from, pos)) != npos; pos += from.length())
+                                count++;
+                        if (!count || !an_alloc(length() + count * (to.length() - from.length())))
+                                return;
+                }
+                for (size_t pos = 0; (pos = find(from, pos)) != npos; pos += to.length())
+                        std::string::replace(pos, from.length(), to);
+        }
+        void trim()
+        {
+                size_t first = 0;
+                while (first < length() && isspace((unsigned char)(*this)[first]))
+                        first++;
+                size_t last = length();
+                while (last > first && isspace((unsigned char)(*this)[last - 1]))
+                        last--;
+                erase(last);
+                erase(0, first);
         }
-        template <typename V, typename F>
-        inline size_t print(const V val, const F fmt)     {return print(String(val, fmt));}
-
-        template <typename T>
-        inline size_t write(const T val)                  {return print(val, HEX) / 2;}
-        inline size_t write(const uint8_t* data, int data_len) {return data_len;} // TODO: implement
-
-        template <typename V, typename F>
-        inline size_t println(const V val, const F fmt)   {return print(val, fmt) + println();}
-        template <typename T>
-        inline size_t println(const T val)                {return print(val) + println();}
-        inline size_t println()                           {std::cout << "\n"; return 1;}
-};
-
-// TODO: add debug functionality
-// maybe add the option to add emulated hardware?
-class an_wire
-{
-public:
-        void begin() {};
-        void begin(uint8_t adr);
-        int requestFrom(uint8_t adr, int quant);
-        int requestFrom(uint8_t adr, int quant, bool stop);
-        void beginTransmission(uint8_t adr);
-        void endTransmission();
-        void endTransmission(bool stop);
-        int write(uint8_t val);
-        int write(String str);
-        int write(const uint8_t* data, int len);
-        int available();
-        int read();
-        void setClock(int hz);
-        void onReceive(void(*handler)(int num_bytes));
-        void onRequest(void(*handler)(void));
 };
+/* One side has to be a String already, so numbers are never converted to add them */
+template <typename L, typename R, typename std::enable_if<std::is_same<L, String>::value, int>::type = 0>
+inline String operator+(L lhs, const R& rhs) {lhs += rhs; return lhs;}
+template <typename L, typename R, typename std::enable_if<!std::is_base_of<std::string, L>::value &&
+                                                          std::is_same<R, String>::value, int>::type = 0>
+inline String operator+(const L& lhs, const R& rhs) {String res(lhs); res += rhs; return res;}
 
-an_serial Serial;
-an_wire Wire;
-
+#ifndef _WIN32
+void serialEvent() __attribute__((weak));
 #ifdef AN_TEENSY_41
-an_serial Serial1;
-an_serial Serial2;
-an_wire Wire1;
-an_wire Wire2;
+void serialEvent1() __attribute__((weak));
+void serialEvent2() __attribute__((weak));
+#endif
 #endif
 
-// Implimentation
-#ifdef AN_IMPL
-
-unsigned long an_start_time_ms;
-unsigned long an_start_time_micros;
-typedef enum {
-        an_analog,
-        an_digital,
-        an_pwm,
-        an_int_pin,
-} an_pin_types_t;
+/* Single producer, single consumer byte ring. head and tail run freely and
+ * are masked on access, so the buffer holds exactly N bytes. */
+template <size_t N>
+class an_ring_buffer
+{
+        static_assert(N && !(N & (N - 1)), "ring buffer size must be a power of two");
+private:
+        uint8_t data[N];
+        std::atomic<size_t> head{0};
+        std::atomic<size_t> tail{0};
+public:
+        inline size_t size() const {return head.load(std::memory_order_acquire) - tail.load(std::memory_order_relaxed);}
+        inline size_t capacity() const {return N;}
+        inline bool empty() const {return size() == 0;}
+        inline uint8_t at(const size_t i) const {return data[(tail.load(std::memory_order_relaxed) + i) & (N - 1)];}
+        inline const uint8_t* contiguous(size_t& len) const
+        {
+                size_t t = tail.load(std::memory_order_relaxed);
+                len = size();
+                if (len > N - (t & (N - 1)))
+                        len = N - (t & (N - 1));
+                return data + (t & (N - 1));
+        }
+        inline void drop(const size_t count) {tail.store(tail.load(std::memory_order_relaxed) + count, std::memory_order_release);}
+        inline void clear() {drop(size());}
+        inline bool push(const uint8_t c)
+        {
+                size_t h = head.load(std::memory_order_relaxed);
+                if (h - tail.load(std::memory_order_acquire) == N)
+                        return false;
+                data[h & (N - 1)] = c;
+                head.store(h + 1, std::memory_order_release);
+                return true;
+        }
+        size_t push(const uint8_t* buf, const size_t len)
+        {
+                size_t count = 0;
+                while (count < len && push(buf[count]))
+                        count++;
+                return count;
+        }
+};
+
+#ifdef AN_SESSION
+class an_serial;
+// counts a place where ISRs and bytes from other threads can reach the sketch, then services them
+void an_session_point();
+// hands over what reached the sketch since the last point, without counting
+void an_session_sync();
+// true when the bytes came from another thread and have to wait for a session point
+bool an_session_stage(an_serial& port, const uint8_t* data, const size_t len);
+// logs a line of input, or replaces it with the logged one
+void an_session_input(std::string& input);
+bool an_session_replaying();
+// a replay in real time doesn't wait for anything, virtual time replays by itself
+#ifdef AN_VIRTUAL_TIME
+#define an_session_skip_wait() false
+#else
+#define an_session_skip_wait() an_session_replaying()
+#endif
+#else
+#define an_session_point()
+#define an_session_sync()
+#define an_session_input(input)
+#define an_session_replaying() false
+#define an_session_skip_wait() false
+#define an_session_value(value) (value)
+#define an_session_time(type, value) (value)
+#endif
+
+/* Line buffered on a terminal, batched when piped to a file or another program.
+ * stdout is only looked at once, boards and ports made later reuse the answer. */
+inline an_flush_policy_t an_default_flush_policy()
+{
+#ifndef _WIN32
+        static const an_flush_policy_t policy = isatty(fileno(stdout)) ? AN_FLUSH_NEWLINE : AN_FLUSH_FULL;
+        return policy;
+#else
+        return AN_FLUSH_NEWLINE;
+#endif
+}
+
+class an_serial
+{
+private:
+        an_ring_buffer<AN_SERIAL_RX_BUFFER_SIZE> rx;
+        unsigned long timeout_ms = 1000;
+        const uint8_t an_port;
+        unsigned long baud = 0;
+#ifdef AN_ESTIMATE
+        /* target cycle at which the UART has sent out everything queued so far */
+        uint64_t est_tx_done = 0;
+#endif
+        char tx[AN_SERIAL_TX_BUFFER_SIZE];
+        size_t tx_len = 0;
+        std::atomic_flag tx_lock = ATOMIC_FLAG_INIT;
+        an_flush_policy_t flush_policy = an_default_flush_policy();
+        void an_tx_out(const char* data, const size_t len)
+        {
+#ifdef __linux__
+                if (io_bound) {
+                        int fd = io_fd.load();
+                        /* a full pty or socket drops output instead of stalling the sketch */
+                        for (size_t done = 0; fd >= 0 && done < len;) {
+                                ssize_t n = ::write(fd, data + done, len - done);
+                                if (n <= 0)
+                                        break;
+                                done += n;
+                        }
+                        return;
+                }
+#endif
+                fwrite(data, 1, len, stdout);
+                fflush(stdout);
+        }
+        void an_tx_flush_locked()
+        {
+                if (!tx_len)
+                        return;
+                an_tx_out(tx, tx_len);
+                tx_len = 0;
+        }
+#ifdef __linux__
+        /* bound file descriptor, -1 when nothing is bound or no client is connected */
+        std::atomic<int> io_fd{-1};
+        int io_listen_fd = -1;
+        bool io_bound = false;
+        bool io_is_file = false;
+        std::atomic<bool> io_stalled{false};
+        std::string io_name;
+        friend class an_serial_io;
+#endif
+        inline void an_rx_drop(const size_t count)
+        {
+                rx.drop(count);
+#ifdef __linux__
+                /* the I/O thread stops reading when the buffer is full, start it again */
+                if (io_stalled.load(std::memory_order_relaxed) && io_stalled.exchange(false))
+                        an_io_resume();
+#endif
+        }
+        void an_io_resume();
+        void an_io_read();
+        void an_io_accept();
+        static inline bool is_num_char(const uint8_t c, const bool is_float)
+        {
+                return c == '-' || (c >= '0' && c <= '9') || (is_float && c == '.');
+        }
+        /* Waits up to the timeout until more than count bytes are buffered. Only a bound
+         * port can receive data while the sketch waits, otherwise this returns at once. */
+        bool an_rx_wait(const size_t count)
+        {
+                an_session_point();
+                if (rx.size() > count || an_session_replaying())
+                        return rx.size() > count;
+#ifdef __linux__
+                if (!io_bound)
+                        return false;
+                auto end = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout_ms);
+                while (rx.size() <= count) {
+                        if (std::chrono::steady_clock::now() >= end)
+                                return false;
+                        std::this_thread::sleep_for(std::chrono::microseconds(50));
+                        an_session_sync();
+                }
+                return true;
+#else
+                return false;
+#endif
+        }
+        inline bool skip_alpha(LookaheadMode lookahead, bool is_float, char ignore)
+        {
+                while(an_rx_wait(0)) {
+                        uint8_t c = rx.at(0);
+                        if (is_num_char(c, is_float))
+                                return true;
+                        if (c == ignore || lookahead == SKIP_ALL ||
+                            (lookahead == SKIP_WHITESPACE && isspace(c))) {
+                                an_rx_drop(1);
+                                continue;
+                        }
+                        return false;
+                }
+                return false;
+        }
+        static inline bool is_digit_char(const uint8_t c, const bool is_float)
+        {
+                return (c >= '0' && c <= '9') || (is_float && c == '.');
+        }
+        /* Parses the number at the front of the buffer. Like Arduino a '-' only counts
+         * in front of the digits, so "--5" is -5 and "5-3" stops at the 5. The bytes
+         * are used in place when they are contiguous, otherwise they are gathered on the stack. */
+        template <typename T>
+        T parse_num(bool is_float, char ignore)
+        {
+                T res = 0;
+                size_t len;
+                const uint8_t* data = rx.contiguous(len);
+                size_t n = 0;
+                while (n < len && data[n] == '-' && data[n] != (uint8_t)ignore)
+                        n++;
+                const size_t signs = n;
+                while (n < len && is_digit_char(data[n], is_float))
+                        n++;
+                if (n < len && data[n] != (uint8_t)ignore) {
+                        const char* first = (const char*)data + (signs ? signs - 1 : 0);
+                        std::from_chars(first, (const char*)data + n, res);
+                        an_rx_drop(n);
+                        return res;
+                }
+
+                char num[64];
+                n = 0;
+                size_t pos = 0;
+                bool digits = false;
+                for (; an_rx_wait(pos); pos++) {
+                        uint8_t c = rx.at(pos);
+                        if (c == (uint8_t)ignore)
+                                continue;
+                        if (c == '-' && !digits) {
+                                num[0] = '-';
+                                n = 1;
+                                continue;
+                        }
+                        if (!is_digit_char(c, is_float))
+                                break;
+                        digits = true;
+                        if (n < sizeof(num))
+                                num[n++] = c;
+                }
+                std::from_chars(num, num + n, res);
+                an_rx_drop(pos);
+                return res;
+        }
+public:
+#ifdef AN_SESSION
+        /* bytes received by other threads, the sketch gets them at its next session point */
+        std::mutex an_stage_lock;
+        std::string an_staged;
+        std::atomic<size_t> an_staged_len{0};
+        inline uint8_t an_port_number() const {return an_port;}
+#endif
+        an_serial(const uint8_t port = 0) : an_port(port) {}
+        inline size_t available()
+        {
+                an_session_point();
+                return rx.size();
+        }
+        inline size_t availableForWrite() {return sizeof(tx) - tx_len;}
+        inline void begin(unsigned speed) {baud = speed;}
+        inline void begin(unsigned speed, int config) {baud = speed;}
+        inline void end() {}
+        inline void flush()
+        {
+                an_tx_flush();
+#ifdef AN_ESTIMATE
+                an_estimate_wait(est_tx_done);
+#endif
+        }
+        inline void setTimeout(const long new_time) {timeout_ms = new_time;}
+        String readString()
+        {
+                String str;
+                while (an_rx_wait(0)) {
+                        size_t len;
+                        const uint8_t* data = rx.contiguous(len);
+                        str.append((const char*)data, len);
+                        an_rx_drop(len);
+                }
+                return str;
+        }
+        String readStringUntil(const char terminator)
+        {
+                String str;
+                while (an_rx_wait(0)) {
+                        char c = read();
+                        if (c == terminator)
+                                break;
+                        str += c;
+                }
+                return str;
+        }
+        void an_take_input()
+        {
+#ifdef AN_FUZZ
+                /* fuzzed input only comes from the fuzzer */
+                return;
+#endif
+                an_tx_flush();
+                std::cout << "ArduinoNative is requesting Serial input: ";
+                std::string input;
+                if (!an_session_replaying())
+                        std::getline(std::cin >> std::ws, input);
+                an_session_input(input);
+                an_receive((const uint8_t*)input.data(), input.length());
+        }
+        // read from and write to a file descriptor instead of stdin/stdout
+        bool an_bind_fd(const int fd);
+        // create a pseudo-terminal for the port, returns the path other programs can open
+        const char* an_bind_pty();
+        // listen on a UNIX socket, the connected client is used for input and output
+        bool an_bind_socket(const char* path);
+        // put bytes in the receive buffer, bytes that don't fit are lost like on the hardware
+        inline size_t an_receive(const uint8_t* data, const size_t len)
+        {
+#ifdef AN_SESSION
+                if (an_session_stage(*this, data, len))
+                        return len;
+#endif
+                size_t count = rx.push(data, len);
+                an_trace_event(AN_TRACE_SERIAL_RX, an_port, 0, count);
+                return count;
+        }
+        inline int peek() {return available() ? rx.at(0) : -1;}
+        inline int read()
+        {
+                int read_byte = peek();
+                if (read_byte >= 0)
+                        an_rx_drop(1);
+                return read_byte;
+        }
+        size_t readBytes(char* buffer, const unsigned length, const bool is_until = false, const char terminator = '\0')
+        {
+                size_t count = 0;
+                for(; count < length; count++) {
+                        int c = an_rx_wait(0) ? read() : -1;
+                        if (c < 0 || (is_until && c == terminator))
+                                break;
+                        *buffer++ = c;
+                }
+                return count;
+        }
+        inline size_t readBytesUntil(const char terminator, char* buffer, const unsigned length)
+        {
+                return readBytes(buffer, length, true, terminator);
+        }
+        /* Consumes the buffer up to and including target or terminal, whichever comes first.
+         * Returns true if target was found. */
+        bool findUntil(const char* target, const size_t len, const char* terminal, const size_t term_len)
+        {
+                size_t avail = available();
+                for (size_t i = 0; i < avail; i++) {
+                        for (int is_term = 0; is_term < 2; is_term++) {
+                                const char* str = is_term ? terminal : target;
+                                size_t str_len = is_term ? term_len : len;
+                                if (!str_len || i + str_len > avail)
+                                        continue;
+                                size_t j = 0;
+                                while (j < str_len && rx.at(i + j) == (uint8_t)str[j])
+                                        j++;
+                                if (j == str_len) {
+                                        an_rx_drop(i + str_len);
+                                        return !is_term;
+                                }
+                        }
+                }
+                an_rx_drop(available());
+                return false;
+        }
+        inline bool find(const char* target) {return findUntil(target, strlen(target), "", 0);}
+        inline bool find(const char* target, const size_t len) {return findUntil(target, len, "", 0);}
+        inline bool find(const char target) {return findUntil(&target, 1, "", 0);}
+        inline bool findUntil(const char* target, const char* terminal)
+        {
+                return findUntil(target, strlen(target), terminal, strlen(terminal));
+        }
+        long parseInt(const LookaheadMode lookahead = SKIP_ALL, const char ignore = NO_IGNORE_CHAR)
+        {
+                if (!skip_alpha(lookahead, false, ignore))
+                        return 0;
+                return parse_num<long>(false, ignore);
+        }
+        float parseFloat(const LookaheadMode lookahead = SKIP_ALL, const char ignore = NO_IGNORE_CHAR)
+        {
+                if (!skip_alpha(lookahead, true, ignore))
+                        return 0.0f;
+                return parse_num<float>(true, ignore);
+        }
+        template <typename T> size_t print(const T& val)
+        {
+                an_profile_time(AN_PROF_SERIAL_PRINT, an_port);
+                if constexpr (std::is_convertible<T, const char*>::value) {
+                        return an_tx_write(val, strlen(val));
+                } else if constexpr (std::is_base_of<std::string, T>::value) {
+                        return an_tx_write(val.data(), val.length());
+                } else if constexpr (std::is_same<T, char>::value || std::is_same<T, unsigned char>::value ||
+                                     std::is_same<T, signed char>::value) {
+                        char c = val;
+                        return an_tx_write(&c, 1);
+                } else if constexpr (std::is_same<T, bool>::value) {
+                        return an_tx_write(val ? "1" : "0", 1);
+                } else if constexpr (std::is_arithmetic<T>::value) {
+                        char buf[AN_FMT_MAX];
+                        return an_tx_write(buf, an_format(buf, val));
+                } else {
+                        String str(val);
+                        return an_tx_write(str.data(), str.length());
+                }
+        }
+        template <typename V, typename F>
+        size_t print(const V& val, const F fmt)
+        {
+                an_profile_time(AN_PROF_SERIAL_PRINT, an_port);
+                char buf[AN_FMT_MAX];
+                size_t len = 0;
+                if constexpr (std::is_integral<V>::value && std::is_same<F, an_num_fmt_t>::value)
+                        len = an_format(buf, val, fmt);
+                else if constexpr (std::is_arithmetic<V>::value && std::is_integral<F>::value)
+                        len = an_format(buf, (double)val, (uint8_t)fmt);
+                if (!len) {
+                        String str(val, fmt);
+                        return an_tx_write(str.data(), str.length());
+                }
+                return an_tx_write(buf, len);
+        }
+
+        inline size_t write(const uint8_t val)            {return an_tx_write((const char*)&val, 1);}
+        inline size_t write(const char* str)              {return an_tx_write(str, strlen(str));}
+        inline size_t write(const char* data, const size_t data_len) {return an_tx_write(data, data_len);}
+        inline size_t write(const uint8_t* data, const size_t data_len) {return an_tx_write((const char*)data, data_len);}
+
+        template <typename V, typename F>
+        inline size_t println(const V& val, const F fmt)  {return print(val, fmt) + println();}
+        template <typename T>
+        inline size_t println(const T& val)               {return print(val) + println();}
+        inline size_t println()                           {return an_tx_write("\n", 1);}
+
+        inline void an_set_flush_policy(const an_flush_policy_t policy) {flush_policy = policy;}
+        // drops buffered bytes and settings like a reset of the board, a bound port stays bound
+        void an_reset()
+        {
+                rx.clear();
+                tx_len = 0;
+                timeout_ms = 1000;
+                baud = 0;
+                flush_policy = an_default_flush_policy();
+#ifdef AN_ESTIMATE
+                est_tx_done = 0;
+#endif
+        }
+        /* Copies data into the transmit buffer and writes the buffer out when the flush policy says so */
+        size_t an_tx_write(const char* data, const size_t len)
+        {
+                an_trace_event(AN_TRACE_SERIAL_TX, an_port, 0, len);
+#if defined(AN_ESTIMATE) && defined(AN_TEENSY_41)
+                /* Serial is USB on the Teensy and isn't limited by the baud rate */
+                an_estimate_serial(est_tx_done, an_port ? baud : 0, len);
+#elif defined(AN_ESTIMATE)
+                an_estimate_serial(est_tx_done, baud, len);
+#endif
+                while (tx_lock.test_and_set(std::memory_order_acquire));
+                if (tx_len + len > sizeof(tx))
+                        an_tx_flush_locked();
+                if (len > sizeof(tx)) {
+                        an_tx_out(data, len);
+                } else {
+                        memcpy(tx + tx_len, data, len);
+                        tx_len += len;
+                        if (flush_policy == AN_FLUSH_ALWAYS ||
+                            (flush_policy == AN_FLUSH_NEWLINE && memchr(data, '\n', len)))
+                                an_tx_flush_locked();
+                }
+                tx_lock.clear(std::memory_order_release);
+                return len;
+        }
+        void an_tx_flush()
+        {
+                while (tx_lock.test_and_set(std::memory_order_acquire));
+                an_tx_flush_locked();
+                tx_lock.clear(std::memory_order_release);
+        }
+        ~an_serial() {an_tx_flush();}
+};
+
+/* I2C devices that can be attached to a Wire bus. receive() gets the bytes of a
+ * write transaction and returns false to NACK them, request() fills up to len
+ * bytes for a read and returns how many it sent. A device that isn't ready()
+ * NACKs its address, like an EEPROM in its write cycle. */
+class an_i2c_device
+{
+public:
+        virtual ~an_i2c_device() {}
+        virtual bool ready() {return true;}
+        virtual bool receive(const uint8_t* data, const size_t len) = 0;
+        virtual size_t request(uint8_t* buf, const size_t len) = 0;
+};
+
+/* 24Cxx EEPROM: the first address_bytes of a write set the address pointer, the
+ * rest is written within the current page. Reads continue from the pointer. */
+class an_i2c_eeprom : public an_i2c_device
+{
+private:
+        unsigned long long busy_until = 0;
+        size_t pointer = 0;
+public:
+        std::vector<uint8_t> memory;
+        const size_t page_size;
+        const uint8_t address_bytes;
+        const unsigned long write_us;
+        // a 24C32 by default, 24C01 to 24C16 use a single address byte
+        an_i2c_eeprom(const size_t size = 4096, const size_t page_size = 32,
+                      const uint8_t address_bytes = 2, const unsigned long write_us = 5000)
+                : memory(size, 0xff), page_size(page_size), address_bytes(address_bytes), write_us(write_us) {}
+        bool ready();
+        bool receive(const uint8_t* data, const size_t len);
+        size_t request(uint8_t* buf, const size_t len);
+};
+
+/* Register file of a typical sensor: the first byte of a write selects the
+ * register, following bytes are written to consecutive registers and reads
+ * continue from the selected one. Set registers to the values the sensor reports. */
+class an_i2c_registers : public an_i2c_device
+{
+private:
+        uint8_t pointer = 0;
+public:
+        std::atomic<uint8_t> registers[256] = {};
+        inline void set(const uint8_t reg, const uint8_t val) {registers[reg].store(val, std::memory_order_relaxed);}
+        inline uint8_t get(const uint8_t reg) const {return registers[reg].load(std::memory_order_relaxed);}
+        // stores val big endian from reg on, as most sensors do for 16 bit values
+        inline void set16(const uint8_t reg, const uint16_t val) {set(reg, val >> 8); set(reg + 1, val & 0xff);}
+        bool receive(const uint8_t* data, const size_t len)
+        {
+                if (!len)
+                        return true;
+                pointer = data[0];
+                for (size_t i = 1; i < len; i++)
+                        set(pointer++, data[i]);
+                return true;
+        }
+        size_t request(uint8_t* buf, const size_t len)
+        {
+                for (size_t i = 0; i < len; i++)
+                        buf[i] = get(pointer++);
+                return len;
+        }
+};
+
+/* Master and slave side of an I2C bus. Devices are looked up by address in a
+ * table, transactions are buffered and delivered to the device in one call,
+ * and every transaction takes 9 clocks per byte at the setClock() rate. */
+class an_wire
+{
+private:
+        std::shared_ptr<an_i2c_device> devices[128];
+        uint8_t tx_addr = 0;
+        uint8_t tx[AN_WIRE_BUFFER_SIZE];
+        size_t tx_len = 0;
+        bool transmitting = false;
+        uint8_t rx[AN_WIRE_BUFFER_SIZE];
+        size_t rx_len = 0;
+        size_t rx_pos = 0;
+        unsigned long clock_hz = 100000;
+        unsigned long long bus_ns = 0;
+        unsigned long long pending_ns = 0;
+        int slave_addr = -1;
+        bool in_request = false;
+        void (*receive_handler)(int num_bytes) = nullptr;
+        void (*request_handler)(void) = nullptr;
+        void an_charge(const size_t bytes);
+public:
+        inline void begin() {slave_addr = -1;}
+        inline void begin(const uint8_t adr) {slave_addr = adr & 0x7f;}
+        inline void end() {}
+        uint8_t requestFrom(const uint8_t adr, const uint8_t quant, const bool stop = true);
+        inline void beginTransmission(const uint8_t adr)
+        {
+                tx_addr = adr & 0x7f;
+                tx_len = 0;
+                transmitting = true;
+        }
+        uint8_t endTransmission(const bool stop = true);
+        inline size_t write(const uint8_t val)
+        {
+                if ((!transmitting && !in_request) || tx_len == sizeof(tx))
+                        return 0;
+                tx[tx_len++] = val;
+                return 1;
+        }
+        size_t write(const uint8_t* data, const size_t len)
+        {
+                size_t count = 0;
+                while (count < len && write(data[count]))
+                        count++;
+                return count;
+        }
+        inline size_t write(const int val) {return write((uint8_t)val);}
+        inline size_t write(const unsigned val) {return write((uint8_t)val);}
+        inline size_t write(const long val) {return write((uint8_t)val);}
+        inline size_t write(const unsigned long val) {return write((uint8_t)val);}
+        inline size_t write(const char* str) {return write((const uint8_t*)str, strlen(str));}
+        inline size_t write(const String& str) {return write((const uint8_t*)str.data(), str.length());}
+        inline int available() {return rx_len - rx_pos;}
+        inline int read() {return rx_pos < rx_len ? rx[rx_pos++] : -1;}
+        inline int peek() {return rx_pos < rx_len ? rx[rx_pos] : -1;}
+        inline void setClock(const unsigned long hz) {if (hz) clock_hz = hz;}
+        inline void onReceive(void(*handler)(int num_bytes)) {receive_handler = handler;}
+        inline void onRequest(void(*handler)(void)) {request_handler = handler;}
+
+        // put a device model on the bus, replacing whatever was at the address
+        inline void an_attach(const uint8_t adr, std::shared_ptr<an_i2c_device> device) {devices[adr & 0x7f] = device;}
+        inline void an_detach(const uint8_t adr) {devices[adr & 0x7f] = nullptr;}
+        /* Transactions as the master, also reaching the sketch when it is a slave.
+         * an_master_write() returns the endTransmission() status, an_master_read() the bytes read. */
+        uint8_t an_master_write(const uint8_t adr, const uint8_t* data, const size_t len);
+        size_t an_master_read(const uint8_t adr, uint8_t* buf, const size_t len);
+        // time the bus has spent transferring so far
+        inline unsigned long long an_bus_us() const {return bus_ns / 1000;}
+        // drops attached devices, handlers and buffered bytes
+        void an_reset()
+        {
+                for (auto& device : devices)
+                        device = nullptr;
+                tx_addr = 0;
+                tx_len = 0;
+                transmitting = false;
+                rx_len = rx_pos = 0;
+                clock_hz = 100000;
+                bus_ns = pending_ns = 0;
+                slave_addr = -1;
+                in_request = false;
+                receive_handler = nullptr;
+                request_handler = nullptr;
+        }
+};
+
+/* SCHEDULER */
+/* Everything that changes pins over time is a source on the scheduler.
+ * fire() applies the source at time t and returns when it wants to run next,
+ * or ULLONG_MAX when it is done. */
+class an_source
+{
+public:
+        const uint8_t pin;
+        // the scheduler keys sources by their kind and id, the id of a generator is its pin
+        const unsigned id;
+        bool removed = false;
+        an_source(const uint8_t pin) : pin(pin), id(pin) {}
+        an_source(const uint8_t pin, const unsigned id) : pin(pin), id(id) {}
+        virtual ~an_source() {}
+        virtual unsigned long long fire(const unsigned long long t) = 0;
+};
+typedef enum {
+        an_gen_sine,
+        an_gen_square,
+        an_gen_stimulus,
+        an_gen_tone,
+        an_gen_tone_mix,
+        an_gen_waveform,
+        an_gen_fuzz,
+} an_gen_kind_t;
+typedef struct an_event {
+        unsigned long long t;
+        std::shared_ptr<an_source> src;
+        bool operator>(const an_event& other) const {return t > other.t;}
+} an_event_t;
+
+class an_board;
+/* One heap of pending events for all sources of a board. In real time a single thread sleeps
+ * until the earliest event, with AN_VIRTUAL_TIME the events are run by an_advance_time(). */
+class an_scheduler
+{
+public:
+        an_board* const board;
+        std::mutex lock;
+        std::priority_queue<an_event_t, std::vector<an_event_t>, std::greater<an_event_t>> events;
+        std::unordered_map<unsigned long long, std::shared_ptr<an_source>> sources;
+        static inline unsigned long long key(const an_gen_kind_t kind, const unsigned id) {return (unsigned long long)kind << 32 | id;}
+#ifndef AN_VIRTUAL_TIME
+        std::condition_variable wake;
+        std::thread thread;
+        an_source* firing = nullptr;
+        bool stop = false;
+        ~an_scheduler()
+        {
+                if (!thread.joinable())
+                        return;
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+                        stop = true;
+                }
+                wake.notify_all();
+                if (thread.get_id() == std::this_thread::get_id())
+                        thread.detach();
+                else
+                        thread.join();
+        }
+#endif
+        an_scheduler(an_board* board) : board(board) {}
+        void add(const an_gen_kind_t kind, std::shared_ptr<an_source> src, const unsigned long long t);
+        void remove(const an_gen_kind_t kind, const unsigned id);
+        // queues an event for a source that isn't registered under a pin, the lock must not be held
+        void post(std::shared_ptr<an_source> src, const unsigned long long t);
+        void run();
+};
+
+/* TONE */
+typedef struct an_voice {
+        uint8_t pin;
+        unsigned hz;
+        // board time in microseconds, end is ULLONG_MAX for tones without a duration
+        unsigned long long start, end;
+} an_voice_t;
+
+/* Mixes the square waves of all tones of a board into 16 bit mono PCM. Samples
+ * are rendered up to the board time whenever a tone starts or stops, and every
+ * AN_TONE_BLOCK_US while tones play. The WAV header of a file is completed when
+ * the output is closed, a pipe gets a header for a stream of unknown length. */
+class an_tone_mixer
+{
+public:
+        std::mutex lock;
+        std::vector<an_voice_t> voices;
+        FILE* out = nullptr;
+        bool seekable = false;
+        // the block source is scheduled
+        bool streaming = false;
+        // AN_TONE_FILE has been opened once
+        bool opened_default = false;
+        // board time of the first sample, and samples rendered so far
+        unsigned long long origin = 0;
+        unsigned long long samples = 0;
+        ~an_tone_mixer() {close();}
+        // the lock has to be held for all of these
+        bool open(const char* path, const unsigned long long now);
+        void close();
+        void render(const unsigned long long t);
+};
+
+/* ADC */
+/* Conversion settings of a board. Noise comes from a seeded xorshift, so runs
+ * with the same seed and the same reads get the same values. */
+class an_adc
+{
+public:
+        std::atomic<unsigned> read_bits{10};
+        std::atomic<unsigned long> conversion_us{AN_ADC_CONVERSION_US};
+        std::atomic<float> noise_lsb{0.0f};
+        std::mutex lock;
+        uint64_t state = 1;
+        // standard normal sample, the lock must be held
+        float gauss();
+};
+
+/* COMPONENTS */
+/* Simulated hardware attached to the pins of a board. A component is only run
+ * when a pin it watches changes or a time it asked for with wake_at() comes,
+ * so pins nobody watches pay a single mask test for all components together.
+ * Components of a board are run one at a time, and their public functions may
+ * be called from any thread once they are attached. */
+class an_component
+{
+public:
+        an_board* board = nullptr;
+        std::shared_ptr<an_source> timer;
+        virtual ~an_component() {}
+        // called when attached to a board, watch pins and drive their first voltages here
+        virtual void attach() {}
+        // a watched pin changed to voltage at time t in microseconds
+        virtual void changed(const uint8_t pin, const float voltage, const unsigned long long t) {}
+        // a time asked for with wake_at() has come, earlier requests aren't cancelled
+        virtual void wake(const unsigned long long t) {}
+protected:
+        void watch(const uint8_t pin);
+        void wake_at(const unsigned long long t);
+        void drive(const uint8_t pin, const float voltage);
+        float voltage(const uint8_t pin);
+        unsigned long long now();
+        // keeps the components of the board from running
+        std::unique_lock<std::recursive_mutex> hold();
+};
+
+/* Push button between pin and ground (or 5V when active_low is false). Every
+ * press and release bounces a number of times within bounce_us before settling. */
+class an_button : public an_component
+{
+private:
+        bool pressed = false;
+        unsigned bounces_left = 0;
+        unsigned long long next_bounce = 0;
+        uint32_t rng = 0x9e3779b9;
+        inline float level(const bool closed) const {return closed != active_low ? 5.0f : 0.0f;}
+        void set(const bool closed);
+public:
+        const uint8_t pin;
+        const bool active_low;
+        const unsigned long bounce_us;
+        const unsigned bounces;
+        an_button(const uint8_t pin, const bool active_low = true, const unsigned long bounce_us = 2000, const unsigned bounces = 6)
+                : pin(pin), active_low(active_low), bounce_us(bounce_us), bounces(bounces & ~1u) {}
+        void press() {set(true);}
+        void release() {set(false);}
+        bool is_pressed() {auto guard = hold(); return pressed;}
+        void attach();
+        void wake(const unsigned long long t);
+};
+
+/* Potentiometer between ground and vcc with its wiper on pin, position goes from 0 to 1 */
+class an_potentiometer : public an_component
+{
+private:
+        float from = 0, to = 0;
+        unsigned long long sweep_start = 0, sweep_end = 0;
+public:
+        const uint8_t pin;
+        const float vcc;
+        an_potentiometer(const uint8_t pin, const float position = 0.5f, const float vcc = 5.0f)
+                : from(position), to(position), pin(pin), vcc(vcc) {}
+        void set(const float position);
+        // turns to position in ms milliseconds, the wiper moves every AN_SINE_STEP_US
+        void sweep(const float position, const unsigned long ms);
+        float position();
+        void attach();
+        void wake(const unsigned long long t);
+};
+
+/* RC low-pass from in_pin to out_pin. The output is only recomputed while it
+ * settles after the input changed, in steps of an eighth of the time constant. */
+class an_rc_filter : public an_component
+{
+private:
+        float start_v = 0, target_v = 0;
+        unsigned long long start_t = 0, next_step = 0;
+        float at(const unsigned long long t) const;
+public:
+        const uint8_t in_pin, out_pin;
+        const double tau_us;
+        an_rc_filter(const uint8_t in_pin, const uint8_t out_pin, const double ohms, const double farads)
+                : in_pin(in_pin), out_pin(out_pin), tau_us(ohms * farads * 1e6) {}
+        void attach();
+        void changed(const uint8_t pin, const float voltage, const unsigned long long t);
+        void wake(const unsigned long long t);
+};
+
+/* HC-SR04 ultrasonic sensor. A trigger pulse of at least 10 us starts a
+ * measurement, 250 us later echo goes high for 58 us per cm of distance,
+ * or 38 ms when nothing is in range (2-400 cm). */
+class an_hcsr04 : public an_component
+{
+private:
+        unsigned long long trig_rise = ULLONG_MAX, echo_rise = 0, echo_fall = 0;
+        float cm;
+public:
+        const uint8_t trig_pin, echo_pin;
+        an_hcsr04(const uint8_t trig_pin, const uint8_t echo_pin, const float cm = 100.0f)
+                : cm(cm), trig_pin(trig_pin), echo_pin(echo_pin) {}
+        void set_distance(const float distance_cm) {auto guard = hold(); cm = distance_cm;}
+        void attach();
+        void changed(const uint8_t pin, const float voltage, const unsigned long long t);
+        void wake(const unsigned long long t);
+};
+
+/* LED on pin, the brightness is the drive level (voltage / 5V) averaged by the
+ * persistence of the eye, so PWM, tone() and analogWrite() all light it partly. */
+class an_led : public an_component
+{
+private:
+        double level = 0, smoothed = 0, on_total = 0;
+        unsigned long long since = 0, attached_at = 0;
+        void advance(const unsigned long long t);
+public:
+        const uint8_t pin;
+        const double persistence_us;
+        an_led(const uint8_t pin, const double persistence_ms = 20.0) : pin(pin), persistence_us(persistence_ms * 1000.0) {}
+        // 0 to 1, as perceived now
+        float brightness();
+        // average level since it was attached
+        float duty();
+        void attach();
+        void changed(const uint8_t pin, const float voltage, const unsigned long long t);
+};
+
+/* BOARDS */
+typedef struct an_edge {
+        unsigned long long time_us;
+        bool level;
+} an_edge_t;
+
+/* The handler is cleared while the mode is changed, so a reader that
+ * sees a handler also sees the mode that was attached with it */
 typedef struct an_int {
-        void (*intpointer)(void);
-        an_int_mode_t mode;
+        std::atomic<void (*)(void)> intpointer{nullptr};
+        std::atomic<an_int_mode_t> mode{CHANGE};
 } an_int_t;
-std::unordered_map<uint8_t, an_int_t> an_ints;
-std::unordered_map<uint8_t, std::thread> an_sines;
-std::unordered_map<uint8_t, bool> an_sines_terminate;
-std::unordered_map<uint8_t, std::thread> an_squares;
-std::unordered_map<uint8_t, bool> an_squares_terminate;
-bool an_interrupts_enabled = true;
-float an_reference_v = 5.0;
 
-void setup(void);
-void loop(void);
-void an_is_pin_defined(const uint8_t pin, const an_pin_types_t = an_digital);
+/* Everything a simulated board has: pins, interrupts, generators, clock and ports.
+ * The Arduino API works on the board of the calling thread, which is the default
+ * board unless the thread runs a board of an an_runner. */
+class an_board
+{
+public:
+        an_pin_bank pins;
+        an_int_t ints[AN_MAX_PINS];
+        /* bit per pin with an interrupt attached, and the subset using LOW/HIGH */
+        std::atomic<uint64_t> int_mask{0};
+        std::atomic<uint64_t> int_level_mask{0};
+        /* Interrupts raised from other threads, or while interrupts are disabled, are
+         * latched here like the interrupt flags of the AVR, and run on the board's
+         * thread by an_service_interrupts() at the next safe point. */
+        std::atomic<uint64_t> int_pending{0};
+        std::atomic<unsigned long long> int_posted_us[AN_MAX_PINS] = {};
+        std::thread::id main_thread;
+        bool in_isr = false;
+        std::atomic<bool> int_sleeping{false};
+        std::mutex int_sleep_lock;
+        std::condition_variable int_wake;
+        /* Pins somebody waits for an edge on. Edges of these pins are logged with
+         * the time they happened under int_sleep_lock and announced on int_wake,
+         * every other pin write only pays for testing the mask. */
+        static const unsigned edge_log_size = 16;
+        std::atomic<uint64_t> edge_watch{0};
+        unsigned edge_watchers[AN_MAX_PINS] = {};
+        unsigned long long edge_count[AN_MAX_PINS] = {};
+        an_edge_t edge_log[AN_MAX_PINS][edge_log_size] = {};
+        an_isr_latency_t isr_stats = {0, 0, 0};
+        std::atomic<bool> interrupts_enabled{true};
+        std::atomic<float> reference_v{5.0f};
+        /* bit per pin of the output latch (PORTx) and direction (DDRx), digitalWrite()
+         * and pinMode() keep them in step with the port registers */
+        std::atomic<uint64_t> out_latch{0};
+        std::atomic<uint64_t> out_ddr{0};
+        std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now();
+#ifdef AN_VIRTUAL_TIME
+        std::atomic<unsigned long long> virtual_us{0};
+#endif
+#ifdef AN_ESTIMATE
+        /* predicted time on the target, kept apart from the host clock */
+        an_cycle_costs_t costs = AN_CYCLE_COSTS;
+        unsigned long cpu_hz = AN_CPU_HZ;
+        unsigned long deadline_us = AN_ESTIMATE_DEADLINE_US;
+        std::atomic<uint64_t> target_cycles{0};
+        std::atomic<uint64_t> int_posted_target[AN_MAX_PINS] = {};
+        uint64_t est_loop_total = 0, est_loop_min = ULLONG_MAX, est_loop_max = 0, est_misses = 0;
+        uint64_t est_isr_count = 0, est_isr_total = 0, est_isr_max = 0;
+#endif
+#ifdef AN_STRING_HEAP
+        std::atomic<size_t> string_heap{0};
+#endif
+        an_serial serial{0};
+        an_wire wire;
+        an_tone_mixer tone;
+        an_adc adc;
+        /* attached components and the ones watching each pin, see an_component */
+        std::recursive_mutex component_lock;
+        std::vector<std::shared_ptr<an_component>> components;
+        std::vector<an_component*> component_watchers[AN_MAX_PINS];
+        std::atomic<uint64_t> component_watch{0};
+#ifdef AN_SHM
+        std::atomic<an_shm_t*> shm{nullptr};
+        std::string shm_name;
+#endif
+#ifdef AN_TEENSY_41
+        an_serial serial1{1};
+        an_serial serial2{2};
+        an_wire wire1;
+        an_wire wire2;
+#endif
+        /* last so its thread is stopped before the pins it drives go away */
+        an_scheduler sched{this};
+
+        const unsigned index;
+        std::function<void()> setup_fn;
+        std::function<void()> loop_fn;
+        // loop() iterations to run, 0 runs until an_stop()
+        unsigned long long max_loops = 0;
+        unsigned long long loops = 0;
+        std::atomic<bool> stopped{false};
+
+        an_board(const unsigned index = 0) : index(index) {}
+#ifdef AN_SHM
+        ~an_board();
+#endif
+        // runs setup() and then loop() on the calling thread until stopped
+        void run();
+        /* Puts a board that isn't running back in the state it was made in, without
+         * making its buffers and threads again. Strings of the sketch can outlive
+         * the reset, so the String heap keeps counting them. */
+        void reset();
+};
+
+/* Creates independent boards and runs them on a pool of worker threads. Each
+ * worker runs one board from setup() until it stops before taking the next,
+ * so sketch globals declared thread_local are private to the running board. */
+class an_runner
+{
+public:
+        std::vector<std::unique_ptr<an_board>> boards;
+        an_board& add(std::function<void()> setup, std::function<void()> loop, const unsigned long long max_loops = 0);
+        // runs every board and returns when all have stopped, threads 0 uses every core
+        void run(unsigned threads = 0);
+};
+
+extern thread_local an_board* an_board_local;
+// board the Arduino API of the calling thread works on
+inline an_board& an_current_board() {return *an_board_local;}
+inline void an_set_board(an_board& board) {an_board_local = &board;}
+// stops the current board once loop() returns
+inline void an_stop() {an_board_local->stopped = true;}
+// publishes the pins of a board to a POSIX shared memory segment, removed again with the board
+bool an_shm_export(const char* name, an_board& board = an_current_board());
+// attaches a component to a board, it stays attached until detached or the board goes away
+void an_attach_component(std::shared_ptr<an_component> component, an_board& board = an_current_board());
+void an_detach_component(std::shared_ptr<an_component> component);
+#ifdef AN_ESTIMATE
+// predicted timing of a board on the target, the default board is reported at exit
+an_estimate_t an_estimate(an_board& board = an_current_board());
+void an_estimate_report(an_board& board = an_current_board());
+#endif
+
+#ifndef AN_TEENSY_41
+/* Reading PORTx and DDRx gives the latch and reading PINx the pin levels. Writes
+ * drive every changed output of the port at once, and writing ones to PINx
+ * toggles those bits of PORTx like on the ATmega. */
+uint8_t an_port_read(const an_port_t port, const an_port_reg_t reg);
+void an_port_write(const an_port_t port, const an_port_reg_t reg, const uint8_t value);
+class an_port_register
+{
+private:
+        const an_port_t port;
+        const an_port_reg_t reg;
+public:
+        constexpr an_port_register(const an_port_t port, const an_port_reg_t reg) : port(port), reg(reg) {}
+        inline operator uint8_t() const {return an_port_read(port, reg);}
+        /* values are truncated to a byte like on the target, which takes bitClear(PORTB, 5) without warnings */
+        inline const an_port_register& operator=(const unsigned long value) const {an_port_write(port, reg, (uint8_t)value); return *this;}
+        inline const an_port_register& operator=(const an_port_register& other) const {return *this = (uint8_t)other;}
+        inline const an_port_register& operator&=(const unsigned long value) const {return *this = *this & value;}
+        inline const an_port_register& operator^=(const unsigned long value) const {return *this = *this ^ value;}
+        // sbi on PINx only toggles the bits that are set
+        inline const an_port_register& operator|=(const unsigned long value) const {return *this = reg == AN_REG_PIN ? value : *this | value;}
+};
+#define PORTB (an_port_register(AN_PORTB, AN_REG_PORT))
+#define PORTC (an_port_register(AN_PORTC, AN_REG_PORT))
+#define PORTD (an_port_register(AN_PORTD, AN_REG_PORT))
+#define DDRB (an_port_register(AN_PORTB, AN_REG_DDR))
+#define DDRC (an_port_register(AN_PORTC, AN_REG_DDR))
+#define DDRD (an_port_register(AN_PORTD, AN_REG_DDR))
+#define PINB (an_port_register(AN_PORTB, AN_REG_PIN))
+#define PINC (an_port_register(AN_PORTC, AN_REG_PIN))
+#define PIND (an_port_register(AN_PORTD, AN_REG_PIN))
+#endif
+
+#define Serial (an_board_local->serial)
+#define Wire (an_board_local->wire)
+#ifdef AN_TEENSY_41
+#define Serial1 (an_board_local->serial1)
+#define Serial2 (an_board_local->serial2)
+#define Wire1 (an_board_local->wire1)
+#define Wire2 (an_board_local->wire2)
+#endif
+
+// Implimentation
+#ifdef AN_IMPL
+
+an_board an_default_board;
+thread_local an_board* an_board_local = &an_default_board;
+#ifdef AN_STRING_HEAP
+std::atomic<size_t>& an_string_heap() {return an_board_local->string_heap;}
+#endif
+
+// time since start in microseconds, without wrapping
+inline unsigned long long an_now_us()
+{
+#ifdef AN_VIRTUAL_TIME
+        return an_board_local->virtual_us.load();
+#else
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - an_board_local->start_time).count();
+#endif
+}
+
+void setup(void);
+void loop(void);
+void an_is_pin_defined(const uint8_t pin, const an_pin_types_t = an_digital);
+void an_serial_event_run();
+void an_raise_interrupt(const uint8_t pin);
+void an_apply_voltage(const uint8_t pin, const float voltage);
+void an_drive_pins(an_board& board, const uint64_t mask, const uint64_t levels);
+void an_drive_step(an_board& board, const uint64_t mask, const uint64_t levels);
+void an_pin_edge(an_board& board, const uint8_t pin, const bool is_on, const bool turn_on);
+void an_log_edges(an_board& board, uint64_t edges, const uint64_t levels);
+void an_notify_components(an_board& board, const uint8_t pin, const float voltage);
+#ifdef AN_SHM
+void an_shm_pin(an_board& board, const uint8_t pin, const float old_voltage, const float voltage);
+void an_shm_modes(an_board& board, uint64_t pins);
+void an_shm_reference(an_board& board);
+#endif
+void an_poll_level_interrupts();
+void an_service_interrupts();
+#ifndef AN_VIRTUAL_TIME
+void an_sleep_us(const unsigned long long us);
+#endif
+inline void an_safe_point()
+{
+        an_session_point();
+        if (an_board_local->int_pending.load(std::memory_order_relaxed))
+                an_service_interrupts();
+}
+
+#ifdef AN_SESSION
+/* A session logs what the main thread of the default board can't work out by
+ * itself: input, the clocks, random numbers, pin reads, and the ISRs and Serial
+ * bytes other threads hand to it. Those last two are keyed by the number of
+ * session points so far, the places where the sketch could notice them, so a
+ * replay hands them over at the same point without any other thread or waiting.
+ * A record is a type byte followed by LEB128 varints, signed ones are zigzag. */
+typedef enum {
+        AN_REC_VALUE,
+        AN_REC_MICROS,
+        AN_REC_MILLIS,
+        AN_REC_INPUT,
+        AN_REC_ISR,
+        AN_REC_RX,
+        AN_REC_END,
+} an_rec_type_t;
+
+class an_session
+{
+public:
+        static constexpr char magic[8] = "ANSESS";
+        static const uint32_t version = 1;
+        static const size_t header_size = 16;
+        static const size_t flush_size = 1 << 16;
+#ifdef AN_VIRTUAL_TIME
+        static const uint32_t flags = 1;
+#else
+        static const uint32_t flags = 0;
+#endif
+        FILE* file = nullptr;
+        // buffered records when recording, the whole file when replaying
+        std::vector<uint8_t> log;
+        size_t pos = 0;
+        // session points so far, and the point of the last ISR or RX record
+        unsigned long long seq = 0;
+        unsigned long long keyed = 0;
+        unsigned long long records = 0;
+        unsigned long last_time[2] = {};
+        bool active = false;
+
+        void start();
+        void close();
+        ~an_session() {close();}
+
+        void put(uint64_t v)
+        {
+                do {
+                        uint8_t b = v & 0x7f;
+                        v >>= 7;
+                        log.push_back(v ? b | 0x80 : b);
+                } while (v);
+        }
+        void put_signed(const int64_t v) {put((uint64_t)v << 1 ^ (uint64_t)(v >> 63));}
+        void put_bytes(const uint8_t* data, const size_t len)
+        {
+                put(len);
+                log.insert(log.end(), data, data + len);
+        }
+        void mark(const an_rec_type_t type)
+        {
+                if (log.size() >= flush_size)
+                        flush();
+                log.push_back(type);
+                records++;
+        }
+        void mark_keyed(const an_rec_type_t type)
+        {
+                mark(type);
+                put(seq - keyed);
+                keyed = seq;
+        }
+        void flush()
+        {
+                if (file && !log.empty()) {
+                        fwrite(log.data(), 1, log.size(), file);
+                        fflush(file);
+                }
+                log.clear();
+        }
+
+        // a log that ends in the middle of a record was cut short, which ends the replay too
+        uint64_t get()
+        {
+                uint64_t v = 0;
+                for (unsigned shift = 0; shift < 64; shift += 7) {
+                        if (pos >= log.size())
+                                finished();
+                        uint8_t b = log[pos++];
+                        v |= (uint64_t)(b & 0x7f) << shift;
+                        if (!(b & 0x80))
+                                break;
+                }
+                return v;
+        }
+        int64_t get_signed()
+        {
+                uint64_t v = get();
+                return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+        }
+        std::string get_bytes()
+        {
+                size_t len = get();
+                if (log.size() - pos < len)
+                        finished();
+                std::string bytes((const char*)log.data() + pos, len);
+                pos += len;
+                return bytes;
+        }
+        void expect(const an_rec_type_t type)
+        {
+                if (pos >= log.size() || log[pos] == AN_REC_END)
+                        finished();
+                if (log[pos] != type)
+                        diverged();
+                pos++;
+                records++;
+        }
+        void replay_due(an_board& board);
+
+        [[noreturn]] void finished()
+        {
+                an_default_board.serial.an_tx_flush();
+                std::cerr << "ArduinoNative replayed " << records << " records from " AN_SESSION_FILE "\n";
+                exit(0);
+        }
+        [[noreturn]] void diverged()
+        {
+                an_default_board.serial.an_tx_flush();
+                std::cout << "ERROR: SESSION DIVERGED FROM " AN_SESSION_FILE " AFTER " << records << " RECORDS\n";
+                exit(1);
+        }
+};
+
+an_session an_sess;
+
+inline bool an_session_main()
+{
+        return an_sess.active && an_board_local == &an_default_board &&
+               std::this_thread::get_id() == an_default_board.main_thread;
+}
+bool an_session_replaying()
+{
+#ifdef AN_REPLAY
+        return an_session_main();
+#else
+        return false;
+#endif
+}
+
+an_serial* an_session_port(const uint8_t port)
+{
+        switch (port) {
+        case 0:
+                return &an_default_board.serial;
+#ifdef AN_TEENSY_41
+        case 1:
+                return &an_default_board.serial1;
+        case 2:
+                return &an_default_board.serial2;
+#endif
+        }
+        return nullptr;
+}
+
+/* The log is written out when the sketch is stopped or crashes, then the signal
+ * does what it would have done */
+void an_session_signal(int sig)
+{
+        an_sess.close();
+        signal(sig, SIG_DFL);
+        raise(sig);
+}
+
+void an_session::start()
+{
+        uint8_t header[header_size] = {};
+        memcpy(header, magic, sizeof(magic));
+#ifdef AN_RECORD
+        for (unsigned i = 0; i < 4; i++) {
+                header[8 + i] = version >> i * 8;
+                header[12 + i] = flags >> i * 8;
+        }
+        file = fopen(AN_SESSION_FILE, "wb");
+        if (!file || fwrite(header, 1, header_size, file) != header_size) {
+                std::cout << "ERROR: CAN'T RECORD SESSION TO " AN_SESSION_FILE "\n";
+                exit(1);
+        }
+        log.reserve(flush_size + 64);
+        for (int sig : {SIGINT, SIGTERM, SIGSEGV, SIGABRT, SIGFPE, SIGILL})
+                signal(sig, an_session_signal);
+#else
+        FILE* in = fopen(AN_SESSION_FILE, "rb");
+        if (!in) {
+                std::cout << "ERROR: CAN'T REPLAY SESSION FROM " AN_SESSION_FILE "\n";
+                exit(1);
+        }
+        uint8_t buf[4096];
+        for (size_t n; (n = fread(buf, 1, sizeof(buf), in));)
+                log.insert(log.end(), buf, buf + n);
+        fclose(in);
+        uint32_t file_version = 0, file_flags = 0;
+        for (unsigned i = 0; log.size() >= header_size && i < 4; i++) {
+                file_version |= (uint32_t)log[8 + i] << i * 8;
+                file_flags |= (uint32_t)log[12 + i] << i * 8;
+        }
+        if (log.size() < header_size || memcmp(log.data(), magic, sizeof(magic)) || file_version != version) {
+                std::cout << "ERROR: " AN_SESSION_FILE " ISN'T A SESSION OF THIS VERSION\n";
+                exit(1);
+        }
+        if (file_flags != flags) {
+                std::cout << "ERROR: " AN_SESSION_FILE " WAS RECORDED WITH OTHER TIME SETTINGS\n";
+                exit(1);
+        }
+        pos = header_size;
+#endif
+        active = true;
+}
+
+void an_session::close()
+{
+        if (!file)
+                return;
+        mark_keyed(AN_REC_END);
+        flush();
+        fclose(file);
+        file = nullptr;
+}
+
+/* Hands over the ISRs and bytes the recording got at the current point, in the
+ * order they came. ISRs taken during an ISR count their own points, so the ones
+ * after it are still due when it returns. */
+void an_session::replay_due(an_board& board)
+{
+        while (pos < log.size()) {
+                const size_t at = pos;
+                const an_rec_type_t type = (an_rec_type_t)log[pos++];
+                if (type != AN_REC_ISR && type != AN_REC_RX && type != AN_REC_END) {
+                        pos = at;
+                        return;
+                }
+                /* the sketch was stopped somewhere after the last point of the log */
+                const unsigned long long when = keyed + get();
+                if (type == AN_REC_END ? when >= seq : when > seq) {
+                        pos = at;
+                        return;
+                }
+                if (type == AN_REC_END)
+                        finished();
+                if (when < seq)
+                        diverged();
+                keyed = when;
+                records++;
+                if (type == AN_REC_ISR) {
+                        void (*intpointer)(void) = board.ints[get() % AN_MAX_PINS].intpointer.load(std::memory_order_acquire);
+                        if (!intpointer)
+                                diverged();
+                        board.in_isr = true;
+                        board.interrupts_enabled = false;
+                        intpointer();
+                        board.interrupts_enabled = true;
+                        board.in_isr = false;
+                } else {
+                        an_serial* port = an_session_port(get());
+                        std::string bytes = get_bytes();
+                        if (!port)
+                                diverged();
+                        port->an_receive((const uint8_t*)bytes.data(), bytes.length());
+                }
+        }
+        finished();
+}
+
+void an_session_point()
+{
+        if (an_session_main())
+                an_sess.seq++;
+        an_service_interrupts();
+}
+
+void an_session_sync()
+{
+        if (!an_session_main() || an_default_board.in_isr)
+                return;
+#ifdef AN_RECORD
+        for (uint8_t n = 0; an_serial* port = an_session_port(n); n++) {
+                if (!port->an_staged_len.load(std::memory_order_acquire))
+                        continue;
+                std::string bytes;
+                {
+                        std::lock_guard<std::mutex> guard(port->an_stage_lock);
+                        bytes.swap(port->an_staged);
+                        port->an_staged_len = 0;
+                }
+                an_sess.mark_keyed(AN_REC_RX);
+                an_sess.put(n);
+                an_sess.put_bytes((const uint8_t*)bytes.data(), bytes.length());
+                port->an_receive((const uint8_t*)bytes.data(), bytes.length());
+        }
+#else
+        an_sess.replay_due(an_default_board);
+#endif
+}
+
+bool an_session_stage(an_serial& port, const uint8_t* data, const size_t len)
+{
+        if (!an_sess.active || std::this_thread::get_id() == an_default_board.main_thread ||
+            an_session_port(port.an_port_number()) != &port)
+                return false;
+#ifdef AN_RECORD
+        std::lock_guard<std::mutex> guard(port.an_stage_lock);
+        port.an_staged.append((const char*)data, len);
+        port.an_staged_len = port.an_staged.length();
+#endif
+        return true;
+}
+
+void an_session_isr(an_board& board, const uint8_t pin)
+{
+#ifdef AN_RECORD
+        if (&board != &an_default_board || !an_sess.active)
+                return;
+        an_sess.mark_keyed(AN_REC_ISR);
+        an_sess.put(pin);
+#endif
+}
+
+void an_session_input(std::string& input)
+{
+        if (!an_session_main())
+                return;
+#ifdef AN_RECORD
+        an_sess.mark(AN_REC_INPUT);
+        an_sess.put_bytes((const uint8_t*)input.data(), input.length());
+#else
+        an_sess.expect(AN_REC_INPUT);
+        input = an_sess.get_bytes();
+#endif
+}
+
+// values of up to 64 bits, floats keep their bits
+template <typename T>
+T an_session_value(T value)
+{
+        static_assert(sizeof(T) <= sizeof(uint64_t), "session values are at most 64 bits");
+        if (!an_session_main())
+                return value;
+        uint64_t bits = 0;
+#ifdef AN_RECORD
+        memcpy(&bits, &value, sizeof(T));
+        an_sess.mark(AN_REC_VALUE);
+        an_sess.put(bits);
+#else
+        an_sess.expect(AN_REC_VALUE);
+        bits = an_sess.get();
+        memcpy(&value, &bits, sizeof(T));
+#endif
+        return value;
+}
+
+// clocks only store how far they moved since the last read
+unsigned long an_session_time(const an_rec_type_t type, unsigned long value)
+{
+        if (!an_session_main())
+                return value;
+        unsigned long& last = an_sess.last_time[type == AN_REC_MILLIS];
+#ifdef AN_RECORD
+        an_sess.mark(type);
+        an_sess.put_signed((int64_t)(value - last));
+#else
+        an_sess.expect(type);
+        value = last + (unsigned long)an_sess.get_signed();
+#endif
+        last = value;
+        return value;
+}
+#endif
+
+#ifdef AN_PROFILE
+/* Log-linear histogram of nanoseconds like HdrHistogram: 16 buckets per power
+ * of two keep every value within 1/16 of its bucket. Counters are only written
+ * by the thread that owns them, so a relaxed load and store is enough. */
+class an_histogram
+{
+public:
+        static const unsigned buckets = 61 * 16;
+        std::atomic<uint64_t> counts[buckets] = {};
+        std::atomic<uint64_t> count{0};
+        std::atomic<uint64_t> total{0};
+        std::atomic<uint64_t> max{0};
+        static inline unsigned bucket(const uint64_t v)
+        {
+                if (v < 16)
+                        return v;
+                unsigned e = 63 - __builtin_clzll(v);
+                return (e - 3) * 16 + ((v >> (e - 4)) & 15);
+        }
+        static inline uint64_t bucket_top(const unsigned i)
+        {
+                if (i < 16)
+                        return i;
+                unsigned e = i / 16 + 3;
+                if (e >= 63)
+                        return ULLONG_MAX;
+                return ((uint64_t)(16 + i % 16 + 1) << (e - 4)) - 1;
+        }
+        static inline void add(std::atomic<uint64_t>& counter, const uint64_t v)
+        {
+                counter.store(counter.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+        }
+        inline void record(const uint64_t v)
+        {
+                add(counts[bucket(v)], 1);
+                add(count, 1);
+                add(total, v);
+                if (v > max.load(std::memory_order_relaxed))
+                        max.store(v, std::memory_order_relaxed);
+        }
+        void merge(const an_histogram& other)
+        {
+                for (unsigned i = 0; i < buckets; i++)
+                        add(counts[i], other.counts[i].load(std::memory_order_relaxed));
+                add(count, other.count.load(std::memory_order_relaxed));
+                add(total, other.total.load(std::memory_order_relaxed));
+                if (other.max.load(std::memory_order_relaxed) > max.load(std::memory_order_relaxed))
+                        max.store(other.max.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        }
+        uint64_t percentile(const double q) const
+        {
+                uint64_t target = (uint64_t)ceil(q * count.load(std::memory_order_relaxed));
+                uint64_t seen = 0;
+                for (unsigned i = 0; i < buckets; i++) {
+                        seen += counts[i].load(std::memory_order_relaxed);
+                        if (seen >= target && seen) {
+                                uint64_t top = bucket_top(i);
+                                return top < max ? top : max.load(std::memory_order_relaxed);
+                        }
+                }
+                return max;
+        }
+};
+
+/* Every thread counts into its own shard, the report merges them */
+typedef struct an_profile_shard {
+        an_histogram loop;
+        an_histogram compute;
+        an_histogram isr;
+        std::atomic<uint64_t> sleep_ns{0};
+        std::atomic<uint64_t> time_ns[AN_PROF_COUNT] = {};
+        /* the last column counts pins outside the board, like AREF */
+        std::atomic<uint64_t> calls[AN_PROF_COUNT][AN_MAX_PINS + 1] = {};
+} an_profile_shard_t;
+
+class an_profiler
+{
+private:
+        std::mutex lock;
+        std::vector<std::unique_ptr<an_profile_shard_t>> shards;
+public:
+        std::atomic<bool> requested{false};
+        an_profiler()
+        {
+                atexit([] {an_profile_report();});
+#ifndef _WIN32
+                signal(SIGUSR1, [](int) {an_profile_request();});
+#endif
+        }
+        static void an_profile_request();
+        an_profile_shard_t* add_shard()
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                shards.push_back(std::make_unique<an_profile_shard_t>());
+                return shards.back().get();
+        }
+        void report()
+        {
+                static const char* names[AN_PROF_COUNT] = {
+                        "digitalWrite", "digitalRead", "analogWrite", "analogRead", "Serial.print",
+                        "shiftOut", "shiftIn", "port", "pulseIn", "delay", "delayMicroseconds", "isr",
+                };
+                auto total = std::make_unique<an_profile_shard_t>();
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+                        for (auto& shard : shards) {
+                                total->loop.merge(shard->loop);
+                                total->compute.merge(shard->compute);
+                                total->isr.merge(shard->isr);
+                                an_histogram::add(total->sleep_ns, shard->sleep_ns);
+                                for (unsigned api = 0; api < AN_PROF_COUNT; api++) {
+                                        an_histogram::add(total->time_ns[api], shard->time_ns[api]);
+                                        for (unsigned pin = 0; pin <= AN_MAX_PINS; pin++)
+                                                an_histogram::add(total->calls[api][pin], shard->calls[api][pin]);
+                                }
+                        }
+                }
+                uint64_t loop_ns = total->loop.total;
+                uint64_t sleep_ns = total->sleep_ns;
+                uint64_t compute_ns = loop_ns > sleep_ns ? loop_ns - sleep_ns : 0;
+                const std::pair<const char*, an_histogram*> hists[] = {
+                        {"loop", &total->loop}, {"compute", &total->compute}, {"isr", &total->isr},
+                };
+
+                fprintf(stderr, "ArduinoNative profile (ns)\n");
+                fprintf(stderr, "%-18s %12s %12s %12s %12s %12s %12s %12s\n",
+                        "", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+                for (auto& h : hists) {
+                        uint64_t n = h.second->count;
+                        fprintf(stderr, "%-18s %12llu %12llu %12llu %12llu %12llu %12llu %12llu\n", h.first,
+                                (unsigned long long)n, (unsigned long long)(n ? h.second->total / n : 0),
+                                (unsigned long long)h.second->percentile(0.5), (unsigned long long)h.second->percentile(0.9),
+                                (unsigned long long)h.second->percentile(0.99), (unsigned long long)h.second->percentile(0.999),
+                                (unsigned long long)h.second->max.load());
+                }
+                fprintf(stderr, "sleeping %llu ns, computing %llu ns\n",
+                        (unsigned long long)sleep_ns, (unsigned long long)compute_ns);
+                fprintf(stderr, "%-18s %12s %14s  calls per pin\n", "api", "calls", "time");
+                for (unsigned api = 0; api < AN_PROF_COUNT; api++) {
+                        uint64_t calls = 0;
+                        for (unsigned pin = 0; pin <= AN_MAX_PINS; pin++)
+                                calls += total->calls[api][pin];
+                        if (!calls)
+                                continue;
+                        fprintf(stderr, "%-18s %12llu %14llu ", names[api], (unsigned long long)calls,
+                                (unsigned long long)total->time_ns[api].load());
+                        for (unsigned pin = 0; pin <= AN_MAX_PINS; pin++)
+                                if (total->calls[api][pin])
+                                        fprintf(stderr, " %u:%llu", pin, (unsigned long long)total->calls[api][pin].load());
+                        fprintf(stderr, "\n");
+                }
+
+                FILE* out = fopen(AN_PROFILE_FILE, "w");
+                if (!out)
+                        return;
+                fprintf(out, "{\n");
+                for (auto& h : hists) {
+                        uint64_t n = h.second->count;
+                        fprintf(out, "  \"%s\": {\"count\": %llu, \"mean_ns\": %llu, \"p50_ns\": %llu, \"p90_ns\": %llu, "
+                                "\"p99_ns\": %llu, \"p999_ns\": %llu, \"max_ns\": %llu},\n", h.first,
+                                (unsigned long long)n, (unsigned long long)(n ? h.second->total / n : 0),
+                                (unsigned long long)h.second->percentile(0.5), (unsigned long long)h.second->percentile(0.9),
+                                (unsigned long long)h.second->percentile(0.99), (unsigned long long)h.second->percentile(0.999),
+                                (unsigned long long)h.second->max.load());
+                }
+                fprintf(out, "  \"sleep_ns\": %llu,\n  \"compute_ns\": %llu,\n  \"api\": {",
+                        (unsigned long long)sleep_ns, (unsigned long long)compute_ns);
+                bool first = true;
+                for (unsigned api = 0; api < AN_PROF_COUNT; api++) {
+                        uint64_t calls = 0;
+                        for (unsigned pin = 0; pin <= AN_MAX_PINS; pin++)
+                                calls += total->calls[api][pin];
+                        fprintf(out, "%s\n    \"%s\": {\"calls\": %llu, \"time_ns\": %llu, \"pins\": {", first ? "" : ",",
+                                names[api], (unsigned long long)calls, (unsigned long long)total->time_ns[api].load());
+                        first = false;
+                        bool first_pin = true;
+                        for (unsigned pin = 0; pin <= AN_MAX_PINS; pin++) {
+                                if (!total->calls[api][pin])
+                                        continue;
+                                fprintf(out, "%s\"%u\": %llu", first_pin ? "" : ", ", pin,
+                                        (unsigned long long)total->calls[api][pin].load());
+                                first_pin = false;
+                        }
+                        fprintf(out, "}}");
+                }
+                fprintf(out, "\n  }\n}\n");
+                fclose(out);
+        }
+};
+/* never destroyed, other threads may still count while the process exits */
+an_profiler& an_prof = *new an_profiler;
+thread_local an_profile_shard_t* an_profile_local = nullptr;
+
+void an_profiler::an_profile_request() {an_prof.requested.store(true, std::memory_order_relaxed);}
+void an_profile_report() {an_prof.report();}
+inline an_profile_shard_t& an_profile_shard()
+{
+        if (!an_profile_local)
+                an_profile_local = an_prof.add_shard();
+        return *an_profile_local;
+}
+void an_profile_count(const an_profile_api_t api, const uint8_t pin)
+{
+        an_histogram::add(an_profile_shard().calls[api][pin < AN_MAX_PINS ? pin : AN_MAX_PINS], 1);
+}
+an_profile_scope::~an_profile_scope()
+{
+        uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+        an_profile_shard_t& shard = an_profile_shard();
+        an_histogram::add(shard.calls[api][pin < AN_MAX_PINS ? pin : AN_MAX_PINS], 1);
+        an_histogram::add(shard.time_ns[api], ns);
+        if (api == AN_PROF_DELAY || api == AN_PROF_DELAYMICROSECONDS)
+                an_histogram::add(shard.sleep_ns, ns);
+        else if (api == AN_PROF_ISR)
+                shard.isr.record(ns);
+}
+#endif
+
+#ifdef AN_ESTIMATE
+/* Every API call charges its cost to the board's target clock. Time spent in
+ * the sketch's own code isn't charged, so predictions are a lower bound. */
+inline void an_estimate_store(std::atomic<uint64_t>& counter, const uint64_t v)
+{
+        counter.store(v, std::memory_order_relaxed);
+}
+void an_estimate_add(const uint64_t cycles)
+{
+        std::atomic<uint64_t>& target = an_board_local->target_cycles;
+        an_estimate_store(target, target.load(std::memory_order_relaxed) + cycles);
+}
+void an_estimate_wait(const uint64_t until)
+{
+        std::atomic<uint64_t>& target = an_board_local->target_cycles;
+        if (until > target.load(std::memory_order_relaxed))
+                an_estimate_store(target, until);
+}
+/* Queuing a byte costs CPU time, and once the UART buffer is full the sketch
+ * waits for the oldest byte to be shifted out at 10 bits per byte */
+void an_estimate_serial(uint64_t& tx_done, const unsigned long baud, const size_t len)
+{
+        an_board& board = *an_board_local;
+        uint64_t now = board.target_cycles.load(std::memory_order_relaxed);
+        if (!baud) {
+                an_estimate_store(board.target_cycles, now + len * board.costs.serial_byte);
+                return;
+        }
+        const uint64_t byte_cycles = (uint64_t)board.cpu_hz * 10 / baud;
+        const uint64_t room = AN_ESTIMATE_TX_BUFFER * byte_cycles;
+        for (size_t i = 0; i < len; i++) {
+                now += board.costs.serial_byte;
+                if (tx_done > now + room)
+                        now = tx_done - room;
+                tx_done = (tx_done > now ? tx_done : now) + byte_cycles;
+        }
+        an_estimate_store(board.target_cycles, now);
+}
+an_estimate_t an_estimate(an_board& board)
+{
+        const double us = 1000000.0 / board.cpu_hz;
+        an_estimate_t est = {};
+        est.target_us = board.target_cycles.load() * 1000000ULL / board.cpu_hz;
+        est.loops = board.loops;
+        if (board.loops) {
+                est.loop_mean_us = (double)board.est_loop_total / board.loops * us;
+                est.loop_min_us = board.est_loop_min * us;
+                est.loop_max_us = board.est_loop_max * us;
+        }
+        est.isr_count = board.est_isr_count;
+        if (board.est_isr_count)
+                est.isr_mean_us = (double)board.est_isr_total / board.est_isr_count * us;
+        est.isr_max_us = board.est_isr_max * us;
+        est.deadline_misses = board.est_misses;
+        return est;
+}
+void an_estimate_report(an_board& board)
+{
+        an_estimate_t est = an_estimate(board);
+        fprintf(stderr, "ArduinoNative estimate for %s at %lu MHz, board %u\n", AN_BOARD_NAME, board.cpu_hz / 1000000, board.index);
+        fprintf(stderr, "target time        %.3f ms\n", est.target_us / 1000.0);
+        fprintf(stderr, "loop period        %llu loops, mean %.1f us, min %.1f us, max %.1f us\n",
+                est.loops, est.loop_mean_us, est.loop_min_us, est.loop_max_us);
+        fprintf(stderr, "isr latency        %llu calls, mean %.1f us, max %.1f us\n", est.isr_count, est.isr_mean_us, est.isr_max_us);
+        if (board.deadline_us)
+                fprintf(stderr, "deadline %lu us     %llu misses\n", board.deadline_us, est.deadline_misses);
+}
+const int an_estimate_at_exit = atexit([] {
+        if (an_default_board.loops)
+                an_estimate_report(an_default_board);
+});
+#endif
+
+void an_board::run()
+{
+        an_board* prev = an_board_local;
+        an_board_local = this;
+        start_time = std::chrono::steady_clock::now();
+        main_thread = std::this_thread::get_id();
+#ifdef AN_SHM
+        if (this == &an_default_board)
+                an_shm_export(AN_SHM_NAME, *this);
+#endif
+#ifdef AN_SESSION
+        if (this == &an_default_board)
+                an_sess.start();
+#endif
+
+        setup_fn();
+#ifdef AN_ESTIMATE
+        uint64_t est_loop_start = target_cycles.load();
+#endif
+        while (!stopped && (!max_loops || loops < max_loops)) {
+#ifdef AN_PROFILE
+                an_profile_shard_t& shard = an_profile_shard();
+                uint64_t slept = shard.sleep_ns.load(std::memory_order_relaxed);
+                auto loop_start = std::chrono::steady_clock::now();
+                loop_fn();
+                uint64_t loop_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - loop_start).count();
+                slept = shard.sleep_ns.load(std::memory_order_relaxed) - slept;
+                shard.loop.record(loop_ns);
+                shard.compute.record(loop_ns > slept ? loop_ns - slept : 0);
+                if (an_prof.requested.load(std::memory_order_relaxed) && an_prof.requested.exchange(false))
+                        an_profile_report();
+#else
+                loop_fn();
+#endif
+                loops++;
+                an_serial_event_run();
+                an_safe_point();
+                an_poll_level_interrupts();
+#ifdef AN_VIRTUAL_TIME
+                an_advance_time(AN_VIRTUAL_LOOP_US);
+#endif
+#ifdef AN_ESTIMATE
+                an_estimate_add(costs.loop);
+                uint64_t period = target_cycles.load() - est_loop_start;
+                est_loop_start += period;
+                est_loop_total += period;
+                est_loop_min = period < est_loop_min ? period : est_loop_min;
+                est_loop_max = period > est_loop_max ? period : est_loop_max;
+                if (deadline_us && period > (uint64_t)deadline_us * cpu_hz / 1000000)
+                        est_misses++;
+#endif
+        }
+        serial.an_tx_flush();
+#ifdef AN_TEENSY_41
+        serial1.an_tx_flush();
+        serial2.an_tx_flush();
+#endif
+        an_board_local = prev;
+}
+
+void an_board::reset()
+{
+        {
+                std::lock_guard<std::mutex> guard(sched.lock);
+                while (!sched.events.empty()) {
+                        sched.events.top().src->removed = true;
+                        sched.events.pop();
+                }
+                for (auto& source : sched.sources)
+                        source.second->removed = true;
+                sched.sources.clear();
+        }
+        {
+                std::lock_guard<std::recursive_mutex> guard(component_lock);
+                for (auto& component : components) {
+                        std::lock_guard<std::mutex> sched_guard(sched.lock);
+                        component->timer->removed = true;
+                }
+                components.clear();
+                for (auto& watchers : component_watchers)
+                        watchers.clear();
+                component_watch = 0;
+        }
+        {
+                std::lock_guard<std::mutex> guard(tone.lock);
+                tone.close();
+                tone.voices.clear();
+                tone.streaming = false;
+                tone.opened_default = false;
+                tone.origin = tone.samples = 0;
+        }
+        {
+                std::lock_guard<std::mutex> guard(adc.lock);
+                adc.read_bits = 10;
+                adc.conversion_us = AN_ADC_CONVERSION_US;
+                adc.noise_lsb = 0.0f;
+                adc.state = 1;
+        }
+        serial.an_reset();
+        wire.an_reset();
+#ifdef AN_TEENSY_41
+        serial1.an_reset();
+        serial2.an_reset();
+        wire1.an_reset();
+        wire2.an_reset();
+#endif
+
+        pins.reset();
+        int_mask = int_level_mask = int_pending = 0;
+        /* nothing runs on the board, so the per pin stores don't need to be ordered */
+        for (unsigned pin = 0; pin < AN_MAX_PINS; pin++) {
+                ints[pin].intpointer.store(nullptr, std::memory_order_relaxed);
+                ints[pin].mode.store(CHANGE, std::memory_order_relaxed);
+                int_posted_us[pin].store(0, std::memory_order_relaxed);
+                edge_watchers[pin] = 0;
+                edge_count[pin] = 0;
+        }
+        in_isr = false;
+        int_sleeping = false;
+        edge_watch = 0;
+        isr_stats = {0, 0, 0};
+        interrupts_enabled = true;
+        reference_v = 5.0f;
+        out_latch = out_ddr = 0;
+        start_time = std::chrono::steady_clock::now();
+#ifdef AN_VIRTUAL_TIME
+        virtual_us = 0;
+#endif
+#ifdef AN_ESTIMATE
+        costs = AN_CYCLE_COSTS;
+        cpu_hz = AN_CPU_HZ;
+        deadline_us = AN_ESTIMATE_DEADLINE_US;
+        target_cycles = 0;
+        for (auto& posted : int_posted_target)
+                posted.store(0, std::memory_order_relaxed);
+        est_loop_total = est_loop_max = est_misses = 0;
+        est_loop_min = ULLONG_MAX;
+        est_isr_count = est_isr_total = est_isr_max = 0;
+#endif
+        max_loops = loops = 0;
+        stopped = false;
+}
+
+an_board& an_runner::add(std::function<void()> setup, std::function<void()> loop, const unsigned long long max_loops)
+{
+        boards.push_back(std::make_unique<an_board>(boards.size()));
+        an_board& board = *boards.back();
+        board.setup_fn = setup;
+        board.loop_fn = loop;
+        board.max_loops = max_loops;
+        return board;
+}
+void an_runner::run(unsigned threads)
+{
+        if (!threads)
+                threads = std::thread::hardware_concurrency();
+        if (!threads)
+                threads = 1;
+        if (threads > boards.size())
+                threads = boards.size();
+        std::atomic<size_t> next{0};
+        std::vector<std::thread> workers;
+        for (unsigned i = 0; i < threads; i++) {
+                workers.emplace_back([&] {
+                        for (size_t n; (n = next++) < boards.size();)
+                                boards[n]->run();
+                });
+        }
+        for (auto& worker : workers)
+                worker.join();
+}
+
+#if !defined(AN_NO_MAIN) && !defined(AN_FUZZ)
+// start program
+int main()
+{
+        an_default_board.setup_fn = setup;
+        an_default_board.loop_fn = loop;
+        an_default_board.run();
+        return 0;
+}
+#endif
+
+/* Like on Arduino serialEvent() is called between loop() iterations when data is available */
+void an_serial_event_run()
+{
+#ifndef _WIN32
+        if (serialEvent && Serial.available())
+                serialEvent();
+#ifdef AN_TEENSY_41
+        if (serialEvent1 && Serial1.available())
+                serialEvent1();
+        if (serialEvent2 && Serial2.available())
+                serialEvent2();
+#endif
+#endif
+}
+
+#ifdef __linux__
+/* One epoll thread fills the receive buffers of every bound port. Ports are
+ * watched one-shot and re-armed after each read, so a port whose buffer is full
+ * is left alone until the sketch reads from it. Regular files can't be watched
+ * by epoll and are read whenever they aren't stalled. */
+class an_serial_io
+{
+private:
+        int epoll_fd = -1;
+        int wake_fd = -1;
+        std::thread thread;
+        std::mutex lock;
+        std::vector<an_serial*> files;
+        std::atomic<bool> stop{false};
+        void start()
+        {
+                epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+                wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+                epoll_event ev = {};
+                ev.events = EPOLLIN;
+                ev.data.u64 = 0;
+                epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev);
+                thread = std::thread(&an_serial_io::run, this);
+        }
+        void wake()
+        {
+                uint64_t one = 1;
+                if (::write(wake_fd, &one, sizeof(one)) < 0)
+                        return;
+        }
+        void run()
+        {
+                epoll_event events[16];
+                while (!stop) {
+                        bool files_ready = false;
+                        {
+                                std::lock_guard<std::mutex> guard(lock);
+                                for (an_serial* port : files)
+                                        files_ready |= !port->io_stalled;
+                        }
+                        int n = epoll_wait(epoll_fd, events, 16, files_ready ? 0 : -1);
+                        for (int i = 0; i < n; i++) {
+                                uint64_t data = events[i].data.u64;
+                                if (!data) {
+                                        uint64_t count;
+                                        if (::read(wake_fd, &count, sizeof(count)) < 0)
+                                                continue;
+                                } else if (data & 1) {
+                                        ((an_serial*)(data & ~1ULL))->an_io_accept();
+                                } else {
+                                        ((an_serial*)data)->an_io_read();
+                                }
+                        }
+                        if (!files_ready)
+                                continue;
+                        std::vector<an_serial*> ready;
+                        {
+                                std::lock_guard<std::mutex> guard(lock);
+                                ready = files;
+                        }
+                        for (an_serial* port : ready)
+                                if (!port->io_stalled)
+                                        port->an_io_read();
+                }
+        }
+public:
+        bool watch(an_serial* port, const int fd, const bool listening)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                if (epoll_fd < 0)
+                        start();
+                epoll_event ev = {};
+                ev.events = listening ? EPOLLIN : EPOLLIN | EPOLLONESHOT;
+                ev.data.u64 = (uintptr_t)port | listening;
+                if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0)
+                        return true;
+                if (errno != EPERM)
+                        return false;
+                port->io_is_file = true;
+                files.push_back(port);
+                wake();
+                return true;
+        }
+        void unwatch(an_serial* port, const int fd)
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+                files.erase(std::remove(files.begin(), files.end(), port), files.end());
+        }
+        void rearm(an_serial* port, const int fd)
+        {
+                if (port->io_is_file) {
+                        wake();
+                        return;
+                }
+                epoll_event ev = {};
+                ev.events = EPOLLIN | EPOLLONESHOT;
+                ev.data.u64 = (uintptr_t)port;
+                epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev);
+        }
+        ~an_serial_io()
+        {
+                if (!thread.joinable())
+                        return;
+                stop = true;
+                wake();
+                if (thread.get_id() == std::this_thread::get_id())
+                        thread.detach();
+                else
+                        thread.join();
+        }
+};
+an_serial_io an_io;
+
+void an_serial::an_io_resume()
+{
+        int fd = io_fd.load();
+        if (fd >= 0)
+                an_io.rearm(this, fd);
+}
+void an_serial::an_io_read()
+{
+        int fd = io_fd.load();
+        if (fd < 0)
+                return;
+        uint8_t buf[4096];
+        size_t space = rx.capacity() - rx.size();
+        ssize_t n = ::read(fd, buf, space < sizeof(buf) ? space : sizeof(buf));
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EINTR)) {
+                an_io.unwatch(this, fd);
+                if (io_listen_fd >= 0) {
+                        /* the socket client left, wait for the next one */
+                        while (tx_lock.test_and_set(std::memory_order_acquire));
+                        io_fd = -1;
+                        close(fd);
+                        tx_lock.clear(std::memory_order_release);
+                }
+                return;
+        }
+        if (n > 0)
+                an_receive(buf, n);
+        if (rx.size() == rx.capacity()) {
+                io_stalled = true;
+                /* the sketch may have emptied the buffer before it saw the stall */
+                if (rx.size() == rx.capacity() || !io_stalled.exchange(false))
+                        return;
+        }
+        if (!io_is_file)
+                an_io.rearm(this, fd);
+}
+void an_serial::an_io_accept()
+{
+        int client = accept4(io_listen_fd, nullptr, nullptr, SOCK_CLOEXEC | SOCK_NONBLOCK);
+        if (client < 0)
+                return;
+        while (tx_lock.test_and_set(std::memory_order_acquire));
+        int old = io_fd.exchange(client);
+        if (old >= 0) {
+                an_io.unwatch(this, old);
+                close(old);
+        }
+        tx_lock.clear(std::memory_order_release);
+        an_io.watch(this, client, false);
+}
+bool an_serial::an_bind_fd(const int fd)
+{
+        io_bound = true;
+        io_fd = fd;
+        return an_io.watch(this, fd, false);
+}
+const char* an_serial::an_bind_pty()
+{
+        int master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+        if (master < 0 || grantpt(master) || unlockpt(master)) {
+                if (master >= 0)
+                        close(master);
+                return nullptr;
+        }
+        io_name = ptsname(master);
+        /* keep the slave open so the master doesn't hang up while no program has it open */
+        int slave = open(io_name.c_str(), O_RDWR | O_NOCTTY | O_CLOEXEC);
+        termios tio;
+        if (slave >= 0 && tcgetattr(slave, &tio) == 0) {
+                cfmakeraw(&tio);
+                tcsetattr(slave, TCSANOW, &tio);
+        }
+        fcntl(master, F_SETFL, fcntl(master, F_GETFL) | O_NONBLOCK);
+        return an_bind_fd(master) ? io_name.c_str() : nullptr;
+}
+bool an_serial::an_bind_socket(const char* path)
+{
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        if (strlen(path) >= sizeof(addr.sun_path))
+                return false;
+        strcpy(addr.sun_path, path);
+        int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0)
+                return false;
+        unlink(path);
+        if (bind(fd, (sockaddr*)&addr, sizeof(addr)) || listen(fd, 1)) {
+                close(fd);
+                return false;
+        }
+        io_name = path;
+        io_listen_fd = fd;
+        io_bound = true;
+        return an_io.watch(this, fd, true);
+}
+#else
+void an_serial::an_io_resume() {}
+void an_serial::an_io_read() {}
+void an_serial::an_io_accept() {}
+bool an_serial::an_bind_fd(const int fd) {return false;}
+const char* an_serial::an_bind_pty() {return nullptr;}
+bool an_serial::an_bind_socket(const char* path) {return false;}
+#endif
+
+/* Wire */
+void an_wire::an_charge(const size_t bytes)
+{
+        /* start, the address and data bytes with their ACK bit, and stop */
+        unsigned long long ns = (9ULL * (bytes + 1) + 2) * 1000000000ULL / clock_hz;
+        bus_ns += ns;
+#ifdef AN_ESTIMATE
+        an_estimate_add(ns * an_board_local->cpu_hz / 1000000000ULL);
+#endif
+#ifdef AN_VIRTUAL_TIME
+        pending_ns += ns;
+        if (pending_ns >= 1000) {
+                an_advance_time(pending_ns / 1000);
+                pending_ns %= 1000;
+        }
+#endif
+}
+uint8_t an_wire::an_master_write(const uint8_t adr, const uint8_t* data, const size_t len)
+{
+        if (adr == slave_addr) {
+                an_charge(len);
+                rx_len = len < sizeof(rx) ? len : sizeof(rx);
+                rx_pos = 0;
+                memcpy(rx, data, rx_len);
+                if (receive_handler)
+                        receive_handler(rx_len);
+                return 0;
+        }
+        an_i2c_device* device = devices[adr & 0x7f].get();
+        if (!device || !device->ready()) {
+                an_charge(0);
+                return 2;
+        }
+        an_charge(len);
+        return device->receive(data, len) ? 0 : 3;
+}
+size_t an_wire::an_master_read(const uint8_t adr, uint8_t* buf, const size_t len)
+{
+        size_t count;
+        if (adr == slave_addr) {
+                /* like on the AVR the reply is written to the transmit buffer by the handler */
+                tx_len = 0;
+                in_request = true;
+                if (request_handler)
+                        request_handler();
+                in_request = false;
+                count = tx_len < len ? tx_len : len;
+                memcpy(buf, tx, count);
+                tx_len = 0;
+        } else {
+                an_i2c_device* device = devices[adr & 0x7f].get();
+                if (!device || !device->ready()) {
+                        an_charge(0);
+                        return 0;
+                }
+                count = device->request(buf, len);
+        }
+        /* the master clocks out every byte it asked for, bytes nobody drives read as 0xff */
+        if (count < len)
+                memset(buf + count, 0xff, len - count);
+        an_charge(len);
+        return len;
+}
+uint8_t an_wire::requestFrom(const uint8_t adr, const uint8_t quant, const bool stop)
+{
+        rx_len = an_master_read(adr & 0x7f, rx, quant < sizeof(rx) ? quant : sizeof(rx));
+        rx_pos = 0;
+        return rx_len;
+}
+uint8_t an_wire::endTransmission(const bool stop)
+{
+        if (!transmitting)
+                return 4;
+        transmitting = false;
+        return an_master_write(tx_addr, tx, tx_len);
+}
+
+bool an_i2c_eeprom::ready()
+{
+        return an_now_us() >= busy_until;
+}
+bool an_i2c_eeprom::receive(const uint8_t* data, const size_t len)
+{
+        if (len < address_bytes)
+                return true;
+        pointer = 0;
+        for (size_t i = 0; i < address_bytes; i++)
+                pointer = pointer << 8 | data[i];
+        pointer %= memory.size();
+        if (len == address_bytes)
+                return true;
+        /* writes wrap around within the page like on the chip */
+        size_t page = pointer - pointer % page_size;
+        for (size_t i = address_bytes; i < len; i++) {
+                memory[pointer] = data[i];
+                pointer = page + (pointer + 1 - page) % page_size;
+        }
+        busy_until = an_now_us() + write_us;
+        return true;
+}
+size_t an_i2c_eeprom::request(uint8_t* buf, const size_t len)
+{
+        for (size_t i = 0; i < len; i++) {
+                buf[i] = memory[pointer];
+                pointer = (pointer + 1) % memory.size();
+        }
+        return len;
+}
+
+#ifdef AN_TRACE
+/* Each thread writes records into its own single producer ring, a background
+ * writer drains all rings into AN_TRACE_FILE. A full ring drops records
+ * rather than blocking the thread that traces. */
+typedef struct an_trace_ring {
+        an_trace_record_t records[AN_TRACE_RING_SIZE];
+        std::atomic<size_t> head{0};
+        std::atomic<size_t> tail{0};
+        std::atomic<size_t> dropped{0};
+        uint32_t thread;
+} an_trace_ring_t;
+
+class an_trace_writer
+{
+private:
+        FILE* file = nullptr;
+        std::mutex lock;
+        std::condition_variable wake;
+        std::vector<std::shared_ptr<an_trace_ring_t>> rings;
+        std::thread thread;
+        bool stop = false;
+        void drain()
+        {
+                std::vector<std::shared_ptr<an_trace_ring_t>> current;
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+                        current = rings;
+                }
+                for (auto& ring : current) {
+                        size_t tail = ring->tail.load(std::memory_order_relaxed);
+                        size_t head = ring->head.load(std::memory_order_acquire);
+                        while (tail != head) {
+                                size_t start = tail % AN_TRACE_RING_SIZE;
+                                size_t count = head - tail;
+                                if (count > AN_TRACE_RING_SIZE - start)
+                                        count = AN_TRACE_RING_SIZE - start;
+                                fwrite(ring->records + start, sizeof(an_trace_record_t), count, file);
+                                tail += count;
+                        }
+                        ring->tail.store(tail, std::memory_order_release);
+                }
+        }
+        void run()
+        {
+                std::unique_lock<std::mutex> guard(lock);
+                while (!stop) {
+                        wake.wait_for(guard, std::chrono::milliseconds(10));
+                        guard.unlock();
+                        drain();
+                        guard.lock();
+                }
+        }
+public:
+        an_trace_writer()
+        {
+                file = fopen(AN_TRACE_FILE, "wb");
+                if (!file)
+                        return;
+                an_trace_header_t header = {{'A', 'N', 'T', 'R', 'A', 'C', 'E', '\0'}, 1, sizeof(an_trace_record_t)};
+                fwrite(&header, sizeof(header), 1, file);
+                thread = std::thread(&an_trace_writer::run, this);
+        }
+        ~an_trace_writer()
+        {
+                if (!file)
+                        return;
+                {
+                        std::lock_guard<std::mutex> guard(lock);
+                        stop = true;
+                }
+                wake.notify_all();
+                if (thread.get_id() == std::this_thread::get_id())
+                        thread.detach();
+                else
+                        thread.join();
+                drain();
+                size_t dropped = 0;
+                for (auto& ring : rings)
+                        dropped += ring->dropped;
+                if (dropped)
+                        std::cerr << "ArduinoNative trace dropped " << dropped << " records\n";
+                fclose(file);
+                file = nullptr;
+        }
+        inline void notify() {wake.notify_one();}
+        std::shared_ptr<an_trace_ring_t> add_ring()
+        {
+                auto ring = std::make_shared<an_trace_ring_t>();
+                std::lock_guard<std::mutex> guard(lock);
+                ring->thread = rings.size();
+                rings.push_back(ring);
+                return ring;
+        }
+};
+an_trace_writer an_tracer;
+thread_local std::shared_ptr<an_trace_ring_t> an_trace_local;
+
+void an_trace_push(const an_trace_type_t type, const uint8_t pin, const float old_value, const float new_value)
+{
+        an_trace_ring_t* ring = an_trace_local.get();
+        if (!ring) {
+                an_trace_local = an_tracer.add_ring();
+                ring = an_trace_local.get();
+        }
+        size_t head = ring->head.load(std::memory_order_relaxed);
+        if (head - ring->tail.load(std::memory_order_acquire) == AN_TRACE_RING_SIZE) {
+                ring->dropped.fetch_add(1, std::memory_order_relaxed);
+                return;
+        }
+        ring->records[head % AN_TRACE_RING_SIZE] = {an_now_us(), old_value, new_value, type, pin, 0, ring->thread};
+        ring->head.store(head + 1, std::memory_order_release);
+        /* don't wait for the writer's next round when the ring is filling up */
+        if ((head + 1) % (AN_TRACE_RING_SIZE / 4) == 0)
+                an_tracer.notify();
+}
+#endif
+
+/* Converts a binary trace to a VCD file for GTKWave. Pins become real valued
+ * voltages, interrupts a wire that toggles on every ISR call and serial ports
+ * byte counters per direction. */
+bool an_trace_export_vcd(const char* trace_path, const char* vcd_path)
+{
+        FILE* in = fopen(trace_path, "rb");
+        if (!in)
+                return false;
+        an_trace_header_t header;
+        std::vector<an_trace_record_t> records;
+        if (fread(&header, sizeof(header), 1, in) != 1 || strcmp(header.magic, "ANTRACE") ||
+            header.record_size != sizeof(an_trace_record_t)) {
+                fclose(in);
+                return false;
+        }
+        an_trace_record_t rec;
+        while (fread(&rec, sizeof(rec), 1, in) == 1)
+                records.push_back(rec);
+        fclose(in);
+        std::stable_sort(records.begin(), records.end(), [](const an_trace_record_t& a, const an_trace_record_t& b) {
+                return a.time_us < b.time_us;
+        });
+
+        FILE* out = fopen(vcd_path, "w");
+        if (!out)
+                return false;
+        /* one identifier per (type, pin), made of printable characters */
+        std::unordered_map<unsigned, std::string> ids;
+        auto id_of = [&](const an_trace_record_t& r) -> std::string& {
+                return ids[r.type << 8 | r.pin];
+        };
+        for (auto& r : records) {
+                std::string& id = id_of(r);
+                if (!id.empty())
+                        continue;
+                for (size_t n = ids.size(); n; n /= 94)
+                        id += (char)('!' + n % 94);
+        }
+        fprintf(out, "$timescale 1us $end\n$scope module arduino $end\n");
+        for (auto& entry : ids) {
+                unsigned type = entry.first >> 8, pin = entry.first & 0xff;
+                if (type == AN_TRACE_PIN)
+                        fprintf(out, "$var real 64 %s pin%u $end\n", entry.second.c_str(), pin);
+                else if (type == AN_TRACE_INT)
+                        fprintf(out, "$var wire 1 %s int%u $end\n", entry.second.c_str(), pin);
+                else
+                        fprintf(out, "$var integer 32 %s serial%u_%s $end\n", entry.second.c_str(), pin,
+                                type == AN_TRACE_SERIAL_RX ? "rx" : "tx");
+        }
+        fprintf(out, "$upscope $end\n$enddefinitions $end\n");
+
+        std::unordered_map<unsigned, uint32_t> counters;
+        uint64_t last_time = ULLONG_MAX;
+        for (auto& r : records) {
+                if (r.time_us != last_time) {
+                        fprintf(out, "#%llu\n", (unsigned long long)r.time_us);
+                        last_time = r.time_us;
+                }
+                const char* id = id_of(r).c_str();
+                unsigned key = r.type << 8 | r.pin;
+                switch (r.type) {
+                case AN_TRACE_PIN:
+                        fprintf(out, "r%g %s\n", r.new_value, id);
+                        break;
+                case AN_TRACE_INT:
+                        fprintf(out, "%u%s\n", (unsigned)(++counters[key] & 1), id);
+                        break;
+                case AN_TRACE_SERIAL_RX:
+                case AN_TRACE_SERIAL_TX: {
+                        uint32_t count = counters[key] += (uint32_t)r.new_value;
+                        fprintf(out, "b%s %s\n", std::bitset<32>(count).to_string().c_str(), id);
+                        break;
+                }}
+        }
+        fclose(out);
+        return true;
+}
+
+/* ArduinoNative reused functions */
+void an_is_pin_defined(uint8_t pin, an_pin_types_t type)
+{
+        if (an_pin_caps.has(pin, type))
+                return;
+        if (!an_pin_caps.has(pin, an_digital))
+                std::cout << "ERROR: PIN " << std::to_string(pin) << " IS NOT DEFINED\n";
+        else
+                std::cout << "ERROR: PIN " << std::to_string(pin) << " CAN'T BE USED FOR " <<
+                        (type == an_analog ? "ANALOG INPUT\n" : type == an_pwm ? "PWM\n" : "INTERRUPTS\n");
+        exit(1);
+}
+void an_print_timestamp()
+{
+        /* keep Serial output in order with debug messages */
+        Serial.an_tx_flush();
+#ifdef AN_DEBUG_TIMESTAMP
+        std::cout << millis() << "ms | ";
+#endif
+}
+
+// Digital I/O
+bool digitalRead(uint8_t pin)
+{
+        an_is_pin_defined(pin);
+        return an_digital_read(pin);
+}
+bool an_digital_read(const uint8_t pin)
+{
+        an_profile_call(AN_PROF_DIGITALREAD, pin);
+        an_estimate_cost(digital_read);
+        an_safe_point();
+        bool res = an_session_value(an_board_local->pins.get(pin) > 3);
+#ifdef AN_DEBUG_DIGITALREAD
+        an_print_timestamp();
+        std::cout << "Read pin: " << std::to_string(pin) << " is " << (res ? "HIGH\n" : "LOW\n");
+#endif
+        return res;
+}
+
+void digitalWrite(uint8_t pin, bool val)
+{
+        an_is_pin_defined(pin);
+        an_digital_write(pin, val);
+}
+void an_digital_write(const uint8_t pin, const bool val)
+{
+        an_profile_call(AN_PROF_DIGITALWRITE, pin);
+        an_estimate_cost(digital_write);
+        an_drive_pins(*an_board_local, 1ULL << pin, (uint64_t)val << pin);
+#ifdef AN_DEBUG_DIGITALWRITE
+        an_print_timestamp();
+        std::cout << "Pin: " << std::to_string(pin) << " is now " << (val ? "HIGH\n" : "LOW\n");
+#endif
+}
+
+void pinMode(uint8_t pin, an_pin_mode_t mode)
+{
+        an_is_pin_defined(pin);
+        an_pin_mode(pin, mode);
+}
+void an_pin_mode(const uint8_t pin, const an_pin_mode_t mode)
+{
+        an_estimate_cost(pin_mode);
+        an_board& board = *an_board_local;
+        const uint64_t bit = 1ULL << pin;
+        if (mode == OUTPUT) {
+                board.out_ddr.fetch_or(bit, std::memory_order_relaxed);
+        } else {
+                board.out_ddr.fetch_and(~bit, std::memory_order_relaxed);
+                if (mode == INPUT_PULLUP)
+                        board.out_latch.fetch_or(bit, std::memory_order_relaxed);
+                else
+                        board.out_latch.fetch_and(~bit, std::memory_order_relaxed);
+        }
+#ifdef AN_SHM
+        an_shm_modes(board, bit);
+#endif
+        if (mode == INPUT_PULLUP) {
+                float old_voltage = board.pins.exchange(pin, 5.0f);
+                (void)old_voltage;
+                an_shm_event(board, pin, old_voltage, 5.0f);
+        }
+}
+
+// Analog I/O
+// like the core, analog channel numbers below A0 mean A0 + n, analogRead(0) reads A0
+static inline uint8_t an_analog_channel_pin(const uint8_t pin) {return pin < A0 ? pin + A0 : pin;}
+uint16_t analogRead(uint8_t pin)
+{
+        pin = an_analog_channel_pin(pin);
+        an_is_pin_defined(pin);
+        return an_analog_read(pin);
+}
+float an_adc::gauss()
+{
+        uint64_t u[2];
+        for (uint64_t& x : u) {
+                state ^= state >> 12;
+                state ^= state << 25;
+                state ^= state >> 27;
+                x = state * 0x2545F4914F6CDD1DULL;
+        }
+        const double u1 = ((u[0] >> 11) + 1) * 0x1p-53, u2 = (u[1] >> 11) * 0x1p-53;
+        return (float)(sqrt(-2.0 * log(u1)) * cos(2.0 * PI * u2));
+}
+void an_adc_noise(const float lsb_rms, const uint64_t seed)
+{
+        an_adc& adc = an_board_local->adc;
+        std::lock_guard<std::mutex> guard(adc.lock);
+        adc.state = seed ? seed : 1;
+        adc.noise_lsb = lsb_rms;
+}
+#ifdef AN_TEENSY_41
+void analogReadResolution(const unsigned bits)
+{
+        an_board_local->adc.read_bits = bits < 1 ? 1 : bits > 16 ? 16 : bits;
+}
+#endif
+
+/* Like the datasheet the code is floor(vin * 2^bits / vref), the sample is held at
+ * the start of the conversion */
+static uint16_t an_adc_convert(an_board& board, const uint8_t pin)
+{
+        constexpr unsigned bits = an_board_traits::adc_bits;
+        double code = board.pins.get(pin) * (1 << bits) / board.reference_v.load();
+        const float noise = board.adc.noise_lsb.load(std::memory_order_relaxed);
+        if (noise > 0) {
+                std::lock_guard<std::mutex> guard(board.adc.lock);
+                code += noise * board.adc.gauss();
+        }
+        uint32_t raw = code <= 0 ? 0 : code >= (1 << bits) - 1 ? (1 << bits) - 1 : (uint32_t)code;
+        const unsigned read_bits = board.adc.read_bits.load(std::memory_order_relaxed);
+        return (uint16_t)(read_bits >= bits ? raw << (read_bits - bits) : raw >> (bits - read_bits));
+}
+// lets the clock of the board reach board time until, generators and interrupts run meanwhile
+static void an_adc_wait(const unsigned long long until)
+{
+        const unsigned long long now = an_now_us();
+        if (until <= now)
+                return;
+#ifdef AN_VIRTUAL_TIME
+        an_advance_time(until - now);
+#else
+        an_sleep_us(until - now);
+#endif
+}
+
+uint16_t an_analog_read(const uint8_t pin)
+{
+        an_profile_call(AN_PROF_ANALOGREAD, pin);
+        an_estimate_cost(analog_read);
+        an_board& board = *an_board_local;
+        an_safe_point();
+        const uint16_t val = an_session_value(an_adc_convert(board, pin));
+        an_adc_wait(an_now_us() + board.adc.conversion_us.load(std::memory_order_relaxed));
+#ifdef AN_DEBUG_ANALOGREAD
+        an_print_timestamp();
+        std::cout << "Analog pin: " << std::to_string(pin) << " is " << val << "\n";
+#endif
+        return val;
+}
+
+/* Sample times are taken from the start, so waiting longer for one sample doesn't
+ * shift the ones after it */
+void an_analog_read_block(uint8_t pin, uint16_t* buf, const size_t n, const double rate)
+{
+        pin = an_analog_channel_pin(pin);
+        an_is_pin_defined(pin);
+        an_profile_call(AN_PROF_ANALOGREAD, pin);
+        an_board& board = *an_board_local;
+        const double conversion = board.adc.conversion_us.load(std::memory_order_relaxed);
+        const double period = rate > 0 && 1000000.0 / rate > conversion ? 1000000.0 / rate : conversion;
+        const unsigned long long start = an_now_us();
+        for (size_t i = 0; i < n; i++) {
+                an_safe_point();
+                buf[i] = an_session_value(an_adc_convert(board, pin));
+                an_adc_wait(start + (unsigned long long)((i + 1) * period + 0.5));
+        }
+#ifdef AN_ESTIMATE
+        an_estimate_add((uint64_t)(n * period * board.cpu_hz / 1000000));
+#endif
+#ifdef AN_DEBUG_ANALOGREAD
+        an_print_timestamp();
+        std::cout << "Analog pin: " << std::to_string(pin) << " sampled " << n << " times\n";
+#endif
+}
+
+/* A pin without PWM is driven like digitalWrite(), HIGH from 128 on, as the core does */
+void analogWrite(uint8_t pin, uint8_t val)
+{
+        an_is_pin_defined(pin);
+        if (!an_pin_caps.has(pin, an_pwm)) {
+                an_digital_write(pin, val >= 128);
+                return;
+        }
+        an_analog_write(pin, val);
+}
+void an_analog_write(const uint8_t pin, const uint8_t val)
+{
+        an_profile_call(AN_PROF_ANALOGWRITE, pin);
+        an_estimate_cost(analog_write);
+        an_apply_voltage(pin, map(val, 0, 255, 0.0f, 5.0f));
+        an_session_point();
+#ifdef AN_DEBUG_ANALOGWRITE
+        an_print_timestamp();
+        std::cout << "Duty cycle on pin: " << std::to_string(pin) << " is now " << val << "\n";
+#endif
+}
+
+void analogReference(an_reference_t type)
+{
+        an_board& board = *an_board_local;
+        switch(type) {
+        case DEFAULT:
+                board.reference_v = 5.0;
+                break;
+        case INTERNAL:
+                board.reference_v = 1.1;
+                break;
+        case INTERNAL1V1:
+                board.reference_v = 1.1;
+                break;
+        case INTERNAL2V56:
+                board.reference_v = 2.56;
+                break;
+        case EXTERNAL:
+                break;
+        }
+#ifdef AN_SHM
+        an_shm_reference(board);
+#endif
+}
+
+void an_set_voltage(uint8_t pin, float voltage)
+{
+        if (pin != AREF)
+                an_is_pin_defined(pin);
+        an_apply_voltage(pin, voltage);
+        an_session_point();
+}
+// an_set_voltage() for a pin that is already checked
+void an_apply_voltage(const uint8_t pin, const float voltage)
+{
+        an_board& board = *an_board_local;
+        if (pin == AREF) {
+                board.reference_v = voltage;
+#ifdef AN_SHM
+                an_shm_reference(board);
+#endif
+                return;
+        }
+        float old_voltage = board.pins.exchange(pin, voltage);
+        an_trace_event(AN_TRACE_PIN, pin, old_voltage, voltage);
+        an_shm_event(board, pin, old_voltage, voltage);
+        if (board.edge_watch.load() >> pin & 1 && (old_voltage > 3) != (voltage > 3))
+                an_log_edges(board, 1ULL << pin, (uint64_t)(voltage > 3) << pin);
+        if (board.component_watch.load(std::memory_order_relaxed) >> pin & 1 && old_voltage != voltage)
+                an_notify_components(board, pin, voltage);
+
+        /* If pin has interrupt attached, most pins don't and stop at the mask */
+        if (board.int_mask.load(std::memory_order_relaxed) >> pin & 1)
+                an_pin_edge(board, pin, old_voltage > 3, voltage > 3);
+}
+
+/* Drives the pins in mask to the levels in one pass over the pin bank, keeping
+ * the output latch in step. Interrupts are only looked at for the pins in mask
+ * that have one attached, so a port write without any costs a single test. */
+void an_drive_pins(an_board& board, const uint64_t mask, const uint64_t levels)
+{
+        board.pins.begin_write();
+        an_drive_step(board, mask, levels);
+        board.pins.end_write();
+        an_session_point();
+}
+
+// an_drive_pins() inside a write section that the caller opened
+void an_drive_step(an_board& board, const uint64_t mask, const uint64_t levels)
+{
+        float old[AN_MAX_PINS];
+        uint64_t was_high = board.pins.drive(mask, levels, old);
+#if defined(AN_TRACE) || defined(AN_SHM)
+        for (uint64_t m = mask; m; m &= m - 1) {
+                uint8_t pin = __builtin_ctzll(m);
+                an_trace_event(AN_TRACE_PIN, pin, old[pin], levels >> pin & 1 ? 5.0f : 0.0f);
+                an_shm_event(board, pin, old[pin], levels >> pin & 1 ? 5.0f : 0.0f);
+        }
+#endif
+        uint64_t latch = board.out_latch.load(std::memory_order_relaxed);
+        board.out_latch.store((latch & ~mask) | (levels & mask), std::memory_order_relaxed);
+        uint64_t edges = mask & (was_high ^ levels) & board.edge_watch.load();
+        if (edges)
+                an_log_edges(board, edges, levels);
+        for (uint64_t watched = mask & board.component_watch.load(std::memory_order_relaxed); watched; watched &= watched - 1) {
+                uint8_t pin = __builtin_ctzll(watched);
+                float voltage = levels >> pin & 1 ? 5.0f : 0.0f;
+                if (old[pin] != voltage)
+                        an_notify_components(board, pin, voltage);
+        }
+        uint64_t ints = mask & board.int_mask.load(std::memory_order_relaxed);
+        while (ints) {
+                uint8_t pin = __builtin_ctzll(ints);
+                ints &= ints - 1;
+                an_pin_edge(board, pin, was_high >> pin & 1, levels >> pin & 1);
+        }
+}
+
+// raises the interrupt of a pin if the change from is_on to turn_on matches its mode
+void an_pin_edge(an_board& board, const uint8_t pin, const bool is_on, const bool turn_on)
+{
+        void (*intpointer)(void) = board.ints[pin].intpointer.load(std::memory_order_acquire);
+        if (!intpointer)
+                return;
+        bool fire = false;
+        switch(board.ints[pin].mode.load(std::memory_order_relaxed)) {
+        case AN_INT_LOW:
+                fire = !turn_on;
+                break;
+        case AN_INT_HIGH:
+                fire = turn_on;
+                break;
+        case CHANGE:
+                fire = is_on != turn_on;
+                break;
+        case RISING:
+                fire = !is_on && turn_on;
+                break;
+        case FALLING:
+                fire = is_on && !turn_on;
+                break;
+        }
+        if (fire)
+                an_raise_interrupt(pin);
+}
+
+void an_raise_interrupt(const uint8_t pin)
+{
+        an_board& board = *an_board_local;
+#ifdef AN_REPLAY
+        /* the ISRs of a replayed session come from the log */
+        if (&board == &an_default_board)
+                return;
+#endif
+        const uint64_t bit = 1ULL << pin;
+        if (!(board.int_pending.load(std::memory_order_relaxed) & bit)) {
+                board.int_posted_us[pin].store(an_now_us(), std::memory_order_relaxed);
+#ifdef AN_ESTIMATE
+                board.int_posted_target[pin].store(board.target_cycles.load(std::memory_order_relaxed), std::memory_order_relaxed);
+#endif
+        }
+        board.int_pending.fetch_or(bit);
+        if (std::this_thread::get_id() == board.main_thread) {
+#ifdef AN_SESSION
+                /* a recorded ISR waits for the next session point, which the replay reaches too */
+                if (&board == &an_default_board)
+                        return;
+#endif
+                an_service_interrupts();
+        } else if (board.int_sleeping) {
+                std::lock_guard<std::mutex> guard(board.int_sleep_lock);
+                board.int_wake.notify_all();
+        }
+}
+
+/* Runs latched interrupts in pin order, with interrupts disabled while an ISR runs */
+void an_service_interrupts()
+{
+        an_board& board = *an_board_local;
+        if (std::this_thread::get_id() != board.main_thread || board.in_isr)
+                return;
+#ifdef AN_SESSION
+        if (&board == &an_default_board) {
+                an_session_sync();
+                if (an_session_replaying())
+                        return;
+        }
+#endif
+        while (board.interrupts_enabled && board.int_pending.load()) {
+                uint64_t pending = board.int_pending.exchange(0);
+                while (pending) {
+                        uint8_t pin = __builtin_ctzll(pending);
+                        pending &= pending - 1;
+                        void (*intpointer)(void) = board.ints[pin].intpointer.load(std::memory_order_acquire);
+                        if (!intpointer)
+                                continue;
+                        unsigned long long latency = an_now_us() - board.int_posted_us[pin].load(std::memory_order_relaxed);
+                        board.isr_stats.count++;
+                        board.isr_stats.total_us += latency;
+                        if (latency > board.isr_stats.max_us)
+                                board.isr_stats.max_us = latency;
+                        an_trace_event(AN_TRACE_INT, pin, 0, 1);
+#ifdef AN_ESTIMATE
+                        /* ISRs queued in front of this one and noInterrupts() sections delay it on the target too */
+                        an_estimate_add(board.costs.isr_entry);
+                        uint64_t est_latency = board.target_cycles.load() - board.int_posted_target[pin].load(std::memory_order_relaxed);
+                        board.est_isr_count++;
+                        board.est_isr_total += est_latency;
+                        if (est_latency > board.est_isr_max)
+                                board.est_isr_max = est_latency;
+#endif
+#ifdef AN_SESSION
+                        an_session_isr(board, pin);
+#endif
+                        board.in_isr = true;
+                        board.interrupts_enabled = false;
+                        {
+                                an_profile_time(AN_PROF_ISR, pin);
+                                intpointer();
+                        }
+                        board.interrupts_enabled = true;
+                        board.in_isr = false;
+                }
+        }
+}
+
+an_isr_latency_t an_isr_latency()
+{
+        return an_board_local->isr_stats;
+}
+
+/* LOW and HIGH interrupts keep firing for as long as the pin holds the level.
+ * They are retriggered at every point where the sketch gives up control:
+ * between loop() iterations, in delay() and when interrupts are enabled again. */
+void an_poll_level_interrupts()
+{
+        an_board& board = *an_board_local;
+        uint64_t levels = board.int_level_mask.load(std::memory_order_relaxed);
+        while (levels && board.interrupts_enabled) {
+                uint8_t pin = __builtin_ctzll(levels);
+                levels &= levels - 1;
+                bool level = board.pins.get(pin) > 3;
+                if (level == (board.ints[pin].mode.load(std::memory_order_relaxed) == AN_INT_HIGH))
+                        an_raise_interrupt(pin);
+        }
+        an_session_point();
+}
+
+an_pin_snapshot_t an_snapshot_pins()
+{
+        return an_board_local->pins.snapshot();
+}
+
+// logs edges of watched pins with the time they happened and wakes the waiters
+void an_log_edges(an_board& board, uint64_t edges, const uint64_t levels)
+{
+        const unsigned long long now = an_now_us();
+        {
+                std::lock_guard<std::mutex> guard(board.int_sleep_lock);
+                while (edges) {
+                        uint8_t pin = __builtin_ctzll(edges);
+                        edges &= edges - 1;
+                        board.edge_log[pin][board.edge_count[pin]++ % an_board::edge_log_size] = {now, (bool)(levels >> pin & 1)};
+                }
+        }
+        board.int_wake.notify_all();
+}
+
+#ifdef AN_SHM
+void an_shm_pin(an_board& board, const uint8_t pin, const float old_voltage, const float voltage)
+{
+        an_shm_t* shm = board.shm.load(std::memory_order_acquire);
+        if (!shm)
+                return;
+        shm->begin.fetch_add(1);
+        shm->voltage[pin].store(voltage, std::memory_order_relaxed);
+        if ((old_voltage > 3) != (voltage > 3))
+                shm->toggles[pin].fetch_add(1, std::memory_order_relaxed);
+        shm->time_us.store(an_now_us(), std::memory_order_relaxed);
+        shm->end.fetch_add(1);
+}
+// modes follow the direction and pull-up bits that pinMode() and DDRx set
+void an_shm_modes(an_board& board, uint64_t pins)
+{
+        an_shm_t* shm = board.shm.load(std::memory_order_acquire);
+        if (!shm)
+                return;
+        const uint64_t ddr = board.out_ddr.load(std::memory_order_relaxed);
+        const uint64_t latch = board.out_latch.load(std::memory_order_relaxed);
+        shm->begin.fetch_add(1);
+        for (pins &= (1ULL << AN_MAX_PINS) - 1; pins; pins &= pins - 1) {
+                uint8_t pin = __builtin_ctzll(pins);
+                shm->mode[pin].store(ddr >> pin & 1 ? OUTPUT : latch >> pin & 1 ? INPUT_PULLUP : INPUT, std::memory_order_relaxed);
+        }
+        shm->time_us.store(an_now_us(), std::memory_order_relaxed);
+        shm->end.fetch_add(1);
+}
+void an_shm_reference(an_board& board)
+{
+        an_shm_t* shm = board.shm.load(std::memory_order_acquire);
+        if (!shm)
+                return;
+        shm->begin.fetch_add(1);
+        shm->reference_v.store(board.reference_v.load(), std::memory_order_relaxed);
+        shm->end.fetch_add(1);
+}
+#endif
+
+/* The segment is sized and filled with the current state before it is
+ * published to the writers, a board exports to a single segment */
+bool an_shm_export(const char* name, an_board& board)
+{
+#if defined(AN_SHM) && !defined(_WIN32)
+        if (board.shm.load())
+                return false;
+        int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+        if (fd < 0)
+                return false;
+        if (ftruncate(fd, sizeof(an_shm_t)) < 0) {
+                ::close(fd);
+                return false;
+        }
+        void* mem = mmap(nullptr, sizeof(an_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (mem == MAP_FAILED)
+                return false;
+        an_shm_t* shm = (an_shm_t*)mem;
+        /* a reader that already mapped an old segment sees it change all at once */
+        shm->begin.fetch_add(1);
+        memset(shm->magic, 0, sizeof(shm->magic));
+        memcpy(shm->magic, "ANSHM", 5);
+        shm->version = AN_SHM_VERSION;
+        shm->size = sizeof(an_shm_t);
+        shm->pin_count = AN_MAX_PINS;
+        shm->pid = getpid();
+        snprintf(shm->board, sizeof(shm->board), "%s", AN_BOARD_NAME);
+        shm->reference_v.store(board.reference_v.load(), std::memory_order_relaxed);
+        an_pin_snapshot_t snap = board.pins.snapshot();
+        for (unsigned pin = 0; pin < AN_SHM_PINS; pin++) {
+                shm->voltage[pin].store(pin < AN_MAX_PINS ? snap.voltage[pin] : 0.0f, std::memory_order_relaxed);
+                shm->mode[pin].store(INPUT, std::memory_order_relaxed);
+                shm->toggles[pin].store(0, std::memory_order_relaxed);
+        }
+        shm->end.store(shm->begin.load());
+        board.shm_name = name;
+        board.shm.store(shm, std::memory_order_release);
+        an_shm_modes(board, ~0ULL);
+        return true;
+#else
+        (void)name;
+        (void)board;
+        return false;
+#endif
+}
+
+#ifdef AN_SHM
+/* Only the name is removed, threads of the board may still be writing to the
+ * mapping, which stays until the process exits */
+an_board::~an_board()
+{
+#ifndef _WIN32
+        if (shm.load())
+                shm_unlink(shm_name.c_str());
+#endif
+}
+#endif
+
+/* Watches a pin for as long as it lives and takes edges from the log in order, so
+ * an edge that happened while the waiter was being woken still counts, with the
+ * time it happened. On the thread running the board interrupts keep running,
+ * and with AN_VIRTUAL_TIME waiting moves the clock to the next generator event
+ * instead of sleeping. */
+class an_edge_waiter
+{
+public:
+        an_board& board;
+        const uint8_t pin;
+        // level after the edges taken so far
+        bool level;
+        unsigned long long seen;
+        an_edge_waiter(an_board& board, const uint8_t pin) : board(board), pin(pin)
+        {
+                std::lock_guard<std::mutex> guard(board.int_sleep_lock);
+                if (!board.edge_watchers[pin]++)
+                        board.edge_watch.fetch_or(1ULL << pin);
+                level = board.pins.get(pin) > 3;
+                seen = board.edge_count[pin];
+        }
+        ~an_edge_waiter()
+        {
+                std::lock_guard<std::mutex> guard(board.int_sleep_lock);
+                if (!--board.edge_watchers[pin])
+                        board.edge_watch.fetch_and(~(1ULL << pin));
+        }
+        // deadline is in microseconds since start, ULLONG_MAX waits forever
+        bool wait(const an_int_mode_t mode, const unsigned long long deadline, unsigned long long& when)
+        {
+                const bool is_main = std::this_thread::get_id() == board.main_thread;
+                /* a board that isn't running belongs to whoever uses it */
+                const bool owner = is_main || board.main_thread == std::thread::id();
+                std::unique_lock<std::mutex> guard(board.int_sleep_lock);
+                for (;;) {
+                        const unsigned long long count = board.edge_count[pin];
+                        if (count - seen > an_board::edge_log_size)
+                                seen = count - an_board::edge_log_size;
+                        while (seen < count) {
+                                const an_edge_t& edge = board.edge_log[pin][seen++ % an_board::edge_log_size];
+                                level = edge.level;
+                                if (mode == CHANGE || mode == (level ? RISING : FALLING)) {
+                                        when = edge.time_us;
+                                        return true;
+                                }
+                        }
+                        const unsigned long long now = an_now_us();
+                        if ((mode == AN_INT_LOW && !level) || (mode == AN_INT_HIGH && level)) {
+                                when = now;
+                                return true;
+                        }
+                        if (now >= deadline)
+                                return false;
+                        auto edged = [&]{return board.edge_count[pin] != seen;};
+#ifdef AN_VIRTUAL_TIME
+                        if (!owner) {
+                                /* the clock moves on the thread running the board */
+                                board.int_wake.wait_for(guard, std::chrono::milliseconds(1), edged);
+                                continue;
+                        }
+                        guard.unlock();
+                        an_service_interrupts();
+                        unsigned long long next = ULLONG_MAX;
+                        {
+                                std::lock_guard<std::mutex> sched_guard(board.sched.lock);
+                                if (!board.sched.events.empty())
+                                        next = board.sched.events.top().t;
+                        }
+                        /* The clock only moves here, so with nothing scheduled and no deadline
+                         * it can't reach an edge and the wait times out instead of hanging */
+                        if (next == ULLONG_MAX && deadline == ULLONG_MAX) {
+                                guard.lock();
+                                if (edged())
+                                        continue;
+                                return false;
+                        }
+                        if (next <= deadline)
+                                an_advance_time(next > now ? next - now : 0);
+                        else
+                                an_advance_time(deadline - now);
+                        guard.lock();
+#else
+                        (void)owner;
+                        if (is_main) {
+                                guard.unlock();
+                                an_service_interrupts();
+                                guard.lock();
+                                board.int_sleeping = true;
+                        }
+                        auto woken = [&]{return edged() || (is_main && board.int_pending.load() && board.interrupts_enabled);};
+                        if (deadline == ULLONG_MAX)
+                                board.int_wake.wait(guard, woken);
+                        else
+                                board.int_wake.wait_until(guard, board.start_time + std::chrono::microseconds(deadline), woken);
+                        if (is_main)
+                                board.int_sleeping = false;
+#endif
+                }
+        }
+};
 
-// start program
-int main()
+bool an_wait_for_edge(const uint8_t pin, const an_int_mode_t mode, const unsigned long timeout, unsigned long long* when)
 {
-        an_start_time_ms = millis();
-        an_start_time_micros = micros();
+        an_is_pin_defined(pin);
+        an_board& board = *an_board_local;
+#ifdef AN_ESTIMATE
+        uint64_t est_start = board.target_cycles.load();
+#endif
+        an_session_point();
+        const unsigned long long start = an_now_us();
+        unsigned long long t = 0;
+        bool res = false;
+        if (!an_session_skip_wait())
+                res = an_edge_waiter(board, pin).wait(mode, timeout ? start + timeout : ULLONG_MAX, t);
+        res = an_session_value(res);
+        t = an_session_value(t);
+#ifdef AN_ESTIMATE
+        if (std::this_thread::get_id() == board.main_thread)
+                board.target_cycles = est_start + (an_now_us() - start) * board.cpu_hz / 1000000;
+#endif
+        if (res && when)
+                *when = t;
+        return res;
+}
 
-        setup();
-        for (;;) loop();
+#ifndef AN_TEENSY_41
+uint8_t an_port_read(const an_port_t port, const an_port_reg_t reg)
+{
+        an_estimate_cost(port_io);
+        an_board& board = *an_board_local;
+        const unsigned first = an_port_first_pin[port];
+        switch (reg) {
+        case AN_REG_PORT:
+                return board.out_latch.load(std::memory_order_relaxed) >> first & an_port_mask(port);
+        case AN_REG_DDR:
+                return board.out_ddr.load(std::memory_order_relaxed) >> first & an_port_mask(port);
+        case AN_REG_PIN:
+                break;
+        }
+        an_safe_point();
+        return an_session_value((uint8_t)(board.pins.levels((uint64_t)an_port_mask(port) << first) >> first));
 }
 
-/* ArduinoNative reused functions */
-void an_is_pin_defined(uint8_t pin, an_pin_types_t type)
+/* Outputs follow PORTx and inputs get their pull-up when their PORTx bit is set.
+ * Only bits that change are driven, all of them in a single an_drive_pins(). */
+void an_port_write(const an_port_t port, const an_port_reg_t reg, uint8_t value)
 {
-        if (pin > AN_MAX_PINS && pin != AREF) {
-                std::cout << "ERROR: PIN " << std::to_string(pin) << " IS NOT DEFINED\n";
-                exit(1);
+        an_profile_call(AN_PROF_PORT, an_port_first_pin[port]);
+        an_estimate_cost(port_io);
+        an_board& board = *an_board_local;
+        const unsigned first = an_port_first_pin[port];
+        const uint64_t pins = (uint64_t)an_port_mask(port) << first;
+        uint64_t all_latch = board.out_latch.load(std::memory_order_relaxed);
+        uint64_t all_ddr = board.out_ddr.load(std::memory_order_relaxed);
+        value &= an_port_mask(port);
+        uint8_t latch = all_latch >> first;
+        uint8_t ddr = all_ddr >> first;
+        uint8_t drive = 0;
+        switch (reg) {
+        case AN_REG_PIN:
+                value ^= latch;
+                /* fall through */
+        case AN_REG_PORT:
+                drive = (latch ^ value) & (ddr | value);
+                board.out_latch.store((all_latch & ~pins) | (uint64_t)value << first, std::memory_order_relaxed);
+                break;
+        case AN_REG_DDR:
+                /* pins that became outputs take the latch, inputs keep their pull-up */
+                drive = (ddr ^ value) & (value | latch);
+                board.out_ddr.store((all_ddr & ~pins) | (uint64_t)value << first, std::memory_order_relaxed);
+#ifdef AN_SHM
+                an_shm_modes(board, pins);
+#endif
+                value = latch;
+                break;
+        }
+        if (drive)
+                an_drive_pins(board, (uint64_t)drive << first, (uint64_t)value << first);
+#ifdef AN_DEBUG_DIGITALWRITE
+        if (reg != AN_REG_DDR) {
+                an_print_timestamp();
+                std::cout << "Port " << "BCD"[port] << " is now " << std::bitset<8>(value) << "\n";
         }
+#endif
 }
-void an_print_timestamp()
+#endif
+
+void an_request_voltage(uint8_t pin)
+{
+        Serial.an_tx_flush();
+        std::cout << "set voltage of pin " << std::to_string(pin) << " to: ";
+#ifdef AN_FUZZ
+        return;
+#endif
+        float voltage = 0;
+        if (!an_session_replaying())
+                std::cin >> voltage;
+        voltage = an_session_value(voltage);
+        an_set_voltage(pin, voltage);
+}
+
+// Time
+#ifdef AN_VIRTUAL_TIME
+void delay(unsigned long ms)
+{
+        an_profile_time(AN_PROF_DELAY, 0);
+        an_session_point();
+#ifdef AN_ESTIMATE
+        an_estimate_add(ms * an_board_local->cpu_hz / 1000);
+#endif
+        an_advance_time(ms * 1000ULL);
+        an_poll_level_interrupts();
+}
+void delayMicroseconds(unsigned long micros)
+{
+        an_profile_time(AN_PROF_DELAYMICROSECONDS, 0);
+        an_session_point();
+#ifdef AN_ESTIMATE
+        an_estimate_add((uint64_t)micros * an_board_local->cpu_hz / 1000000);
+#endif
+        an_advance_time(micros);
+        an_poll_level_interrupts();
+}
+
+unsigned long micros()
+{
+        an_estimate_cost(millis);
+        an_safe_point();
+        return an_session_time(AN_REC_MICROS, (unsigned long)an_board_local->virtual_us.load());
+}
+unsigned long millis()
+{
+        an_estimate_cost(millis);
+        an_safe_point();
+        return an_session_time(AN_REC_MILLIS, (unsigned long)(an_board_local->virtual_us.load() / 1000));
+}
+#else
+/* The main thread sleeps until the deadline or until another thread raises an
+ * interrupt, which then runs during the delay like it would on the hardware */
+void an_sleep_us(const unsigned long long us)
+{
+        an_board& board = *an_board_local;
+        auto end = std::chrono::steady_clock::now() + std::chrono::microseconds(us);
+        if (std::this_thread::get_id() != board.main_thread) {
+                std::this_thread::sleep_until(end);
+                return;
+        }
+        for (;;) {
+                an_service_interrupts();
+                if (an_session_skip_wait() || std::chrono::steady_clock::now() >= end)
+                        break;
+                board.int_sleeping = true;
+                {
+                        std::unique_lock<std::mutex> guard(board.int_sleep_lock);
+                        board.int_wake.wait_until(guard, end, [&board]{return board.int_pending.load() && board.interrupts_enabled;});
+                }
+                board.int_sleeping = false;
+        }
+        an_poll_level_interrupts();
+}
+void delay(unsigned long ms)
+{
+        an_profile_time(AN_PROF_DELAY, 0);
+        an_session_point();
+#ifdef AN_ESTIMATE
+        an_estimate_add(ms * an_board_local->cpu_hz / 1000);
+#endif
+        an_sleep_us(ms * 1000ULL);
+}
+void delayMicroseconds(unsigned long micros)
+{
+        an_profile_time(AN_PROF_DELAYMICROSECONDS, 0);
+        an_session_point();
+#ifdef AN_ESTIMATE
+        an_estimate_add((uint64_t)micros * an_board_local->cpu_hz / 1000000);
+#endif
+        an_sleep_us(micros);
+}
+
+unsigned long micros()
+{
+        an_estimate_cost(millis);
+        an_safe_point();
+        auto duration = std::chrono::steady_clock::now() - an_board_local->start_time;
+        return an_session_time(AN_REC_MICROS, (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(duration).count());
+}
+unsigned long millis()
+{
+        an_estimate_cost(millis);
+        an_safe_point();
+        auto duration = std::chrono::steady_clock::now() - an_board_local->start_time;
+        return an_session_time(AN_REC_MILLIS, (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(duration).count());
+}
+#endif
+
+// Random Numbers
+long random(long max) {return an_session_value(rand()) % max;}
+long random(long min, long max) {return min + an_session_value(rand()) % (max - min);}
+void randomSeed(unsigned long seed) {srand(seed);}
+
+// External Interrupts
+void attachInterrupt(uint8_t interrupt, void (*intpointer)(), int mode)
+{
+        an_board& board = *an_board_local;
+        const int pin = an_pin_caps.pin_of_int[interrupt];
+        if (pin < 0) {
+                std::cerr << "WARNING: INTERRUPT " << std::to_string(interrupt) << " IS NOT DEFINED, USE digitalPinToInterrupt(pin)\n";
+                return;
+        }
+        detachInterrupt(interrupt);
+        board.ints[pin].mode.store((an_int_mode_t)mode, std::memory_order_relaxed);
+        board.ints[pin].intpointer.store(intpointer, std::memory_order_release);
+        board.int_mask.fetch_or(1ULL << pin);
+        if (mode == AN_INT_LOW || mode == AN_INT_HIGH)
+                board.int_level_mask.fetch_or(1ULL << pin);
+}
+void  detachInterrupt(const uint8_t interrupt)
+{
+        an_board& board = *an_board_local;
+        const int pin = an_pin_caps.pin_of_int[interrupt];
+        if (pin < 0)
+                return;
+        board.int_mask.fetch_and(~(1ULL << pin));
+        board.int_level_mask.fetch_and(~(1ULL << pin));
+        board.ints[pin].intpointer.store(nullptr, std::memory_order_release);
+}
+void interrupts()
+{
+        an_board_local->interrupts_enabled = true;
+        an_session_point();
+        an_service_interrupts();
+        an_poll_level_interrupts();
+}
+void noInterrupts() {an_board_local->interrupts_enabled = false;}
+
+// Advanced I/O
+/* Like on the target a pulse that is already going isn't measured, and the timeout
+ * covers waiting for it to end, for the next one to start and for that one to end.
+ * Timeouts and pulse lengths use the time the edges happened, not when the waiter
+ * woke up, a timeout of 0 waits forever. */
+unsigned long pulseIn(const uint8_t pin, const bool val, const unsigned long timeout)
+{
+        an_profile_time(AN_PROF_PULSEIN, pin);
+        an_is_pin_defined(pin);
+        an_board& board = *an_board_local;
+#ifdef AN_ESTIMATE
+        uint64_t est_start = board.target_cycles.load();
+#endif
+        const unsigned long long start = an_now_us();
+        const unsigned long long deadline = timeout ? start + timeout : ULLONG_MAX;
+        const an_int_mode_t begins = val ? RISING : FALLING;
+        const an_int_mode_t ends = val ? FALLING : RISING;
+        unsigned long long rise = 0, fall = 0;
+        bool measured = false;
+        an_session_point();
+        if (!an_session_skip_wait()) {
+                an_edge_waiter waiter(board, pin);
+                measured = (waiter.level != val || waiter.wait(ends, deadline, fall)) &&
+                           waiter.wait(begins, deadline, rise) && waiter.wait(ends, deadline, fall);
+        }
+#ifdef AN_ESTIMATE
+        /* the target waits as long as the pulse takes, not as long as the host polls */
+        board.target_cycles = est_start + (an_now_us() - start) * board.cpu_hz / 1000000;
+#endif
+        return an_session_value(measured ? (unsigned long)(fall - rise) : 0);
+}
+unsigned long pulseInLong(const uint8_t pin, const bool val, const unsigned long timeout)
+{
+        return pulseIn(pin, val, timeout);
+}
+/* shiftIn() and shiftOut() drive the pins directly in one write section per
+ * byte instead of going through digitalWrite(). ISRs still run at every clock
+ * edge, and the target still pays for a digitalWrite() per pin change. */
+uint8_t shiftIn(const uint8_t data_pin, const uint8_t clock_pin, const bool bit_order)
+{
+        an_profile_time(AN_PROF_SHIFTIN, data_pin);
+        an_is_pin_defined(data_pin);
+        an_is_pin_defined(clock_pin);
+        an_board& board = *an_board_local;
+#ifdef AN_ESTIMATE
+        an_estimate_add(16 * board.costs.digital_write + 8 * board.costs.digital_read);
+#endif
+        an_safe_point();
+        const uint64_t clock = 1ULL << clock_pin;
+
+        uint8_t value = 0;
+        uint8_t i;
+
+        board.pins.begin_write();
+        for (i = 0; i < 8; ++i) {
+                an_drive_step(board, clock, clock);
+                if (board.pins.get(data_pin) > 3)
+                        value |= bit_order == LSBFIRST ? 1 << i : 1 << (7 - i);
+                an_drive_step(board, clock, 0);
+        }
+        board.pins.end_write();
+        an_session_point();
+        return an_session_value(value);
+}
+void shiftOut(const uint8_t data_pin, const uint8_t clock_pin, const bool bit_order, byte val)
+{
+        an_profile_time(AN_PROF_SHIFTOUT, data_pin);
+        an_is_pin_defined(data_pin);
+        an_is_pin_defined(clock_pin);
+        an_board& board = *an_board_local;
+#ifdef AN_ESTIMATE
+        an_estimate_add(24 * board.costs.digital_write);
+#endif
+        const uint64_t data = 1ULL << data_pin;
+        const uint64_t clock = 1ULL << clock_pin;
+
+        uint8_t i;
+
+        board.pins.begin_write();
+        for (i = 0; i < 8; i++)  {
+                bool set = bit_order == LSBFIRST ? val >> i & 1 : val >> (7 - i) & 1;
+                an_drive_step(board, data, set ? data : 0);
+                an_drive_step(board, clock, clock);
+                an_drive_step(board, clock, 0);
+        }
+        board.pins.end_write();
+        an_session_point();
+}
+// Generators
+void an_scheduler::add(const an_gen_kind_t kind, std::shared_ptr<an_source> src, const unsigned long long t)
+{
+        remove(kind, src->id);
+        {
+                std::lock_guard<std::mutex> guard(lock);
+                sources[key(kind, src->id)] = src;
+        }
+        post(src, t);
+}
+void an_scheduler::post(std::shared_ptr<an_source> src, const unsigned long long t)
+{
+        std::lock_guard<std::mutex> guard(lock);
+        events.push({t, src});
+#ifndef AN_VIRTUAL_TIME
+        if (!thread.joinable())
+                thread = std::thread(&an_scheduler::run, this);
+        wake.notify_all();
+#endif
+}
+void an_scheduler::remove(const an_gen_kind_t kind, const unsigned id)
+{
+        std::unique_lock<std::mutex> guard(lock);
+        auto pos = sources.find(key(kind, id));
+        if (pos == sources.end())
+                return;
+        pos->second->removed = true;
+#ifndef AN_VIRTUAL_TIME
+        /* wait for a running fire() to finish, unless it is the one removing itself */
+        if (thread.get_id() != std::this_thread::get_id())
+                wake.wait(guard, [&]{return firing != pos->second.get();});
+#endif
+        sources.erase(pos);
+}
+#ifndef AN_VIRTUAL_TIME
+void an_scheduler::run()
+{
+        /* sources drive the pins of the board that owns them */
+        an_board_local = board;
+#ifdef __linux__
+        /* the default slack of 50 us would delay every sample of a kHz waveform */
+        prctl(PR_SET_TIMERSLACK, 1000UL);
+#endif
+        std::unique_lock<std::mutex> guard(lock);
+        while (!stop) {
+                if (events.empty()) {
+                        wake.wait(guard);
+                        continue;
+                }
+                an_event_t ev = events.top();
+                if (ev.src->removed) {
+                        events.pop();
+                        continue;
+                }
+                unsigned long long now = an_now_us();
+                if (ev.t > now) {
+                        wake.wait_for(guard, std::chrono::microseconds(ev.t - now));
+                        continue;
+                }
+                events.pop();
+                firing = ev.src.get();
+                guard.unlock();
+                unsigned long long next = ev.src->fire(ev.t);
+                guard.lock();
+                firing = nullptr;
+                wake.notify_all();
+                if (!ev.src->removed && next != ULLONG_MAX)
+                        events.push({next, ev.src});
+        }
+}
+#else
+void an_advance_time(const unsigned long long us)
+{
+        an_board& board = *an_board_local;
+        const unsigned long long target = board.virtual_us.load() + us;
+        std::unique_lock<std::mutex> guard(board.sched.lock);
+        while (!board.sched.events.empty() && board.sched.events.top().t <= target) {
+                an_event_t ev = board.sched.events.top();
+                board.sched.events.pop();
+                if (ev.src->removed)
+                        continue;
+                /* move the clock first so interrupts see the time of the event */
+                if (ev.t > board.virtual_us.load())
+                        board.virtual_us = ev.t;
+                guard.unlock();
+                unsigned long long next = ev.src->fire(ev.t);
+                guard.lock();
+                if (!ev.src->removed && next != ULLONG_MAX)
+                        board.sched.events.push({next, ev.src});
+        }
+        if (target > board.virtual_us.load())
+                board.virtual_us = target;
+}
+#endif
+
+class an_sine : public an_source
+{
+public:
+        const unsigned hz;
+        const float amp, dc;
+        const bool is_abs;
+        an_sine(const uint8_t pin, const unsigned hz, const float amp, const float dc, const bool is_abs)
+                : an_source(pin), hz(hz), amp(amp), dc(dc), is_abs(is_abs) {}
+        unsigned long long fire(const unsigned long long t)
+        {
+                float v = sin(2.0f * PI * hz * (t / 1000000.0)) * amp + dc;
+                an_set_voltage(pin, is_abs ? fabs(v) : v);
+                return t + AN_SINE_STEP_US;
+        }
+};
+
+/* Square waves are high for the duty part of the period centered at 3/4 of it */
+class an_square : public an_source
+{
+public:
+        const double period, rise, fall;
+        unsigned long long next_rise = ULLONG_MAX, next_fall = ULLONG_MAX;
+        an_square(const uint8_t pin, const unsigned hz, const float duty)
+                : an_source(pin), period(1000000.0 / hz),
+                  rise((0.75 - duty / 2.0) * period), fall((0.75 + duty / 2.0) * period) {}
+        bool level(const unsigned long long t)
+        {
+                double offset = fmod((double)t, period);
+                return (offset >= rise && offset < fall) || offset < fall - period;
+        }
+        unsigned long long next_edge(const double offset, const unsigned long long t)
+        {
+                double edge = (floor((t - offset) / period) + 1.0) * period + offset;
+                unsigned long long edge_us = (unsigned long long)ceil(edge);
+                return edge_us > t ? edge_us : (unsigned long long)ceil(edge + period);
+        }
+        unsigned long long fire(const unsigned long long t)
+        {
+                bool top = level(t);
+                /* At a scheduled edge follow the edge, level() can round to the other side of it */
+                if (next_rise <= t || next_fall <= t)
+                        top = next_rise <= t && (next_fall > t || next_rise > next_fall);
+                if (top != (an_board_local->pins.get(pin) > 3))
+                        an_set_voltage(pin, top * 5.0f);
+                next_rise = next_edge(rise, t);
+                next_fall = next_edge(fall, t);
+                return min(next_rise, next_fall);
+        }
+};
+
+void an_attach_sine(const uint8_t pin, const unsigned hz, const float amp, const float dc, const bool is_abs)
+{
+        an_is_pin_defined(pin);
+        an_board_local->sched.add(an_gen_sine, std::make_shared<an_sine>(pin, hz, amp, dc, is_abs), an_now_us());
+}
+void an_remove_sine(const uint8_t pin)
+{
+        an_is_pin_defined(pin);
+        an_board_local->sched.remove(an_gen_sine, pin);
+}
+void an_attach_square(const uint8_t pin, const unsigned hz, const float duty)
+{
+        an_is_pin_defined(pin);
+        /* a square of 0 Hz stays at its low level */
+        if (!hz) {
+                an_remove_square(pin);
+                an_set_voltage(pin, 0.0f);
+                return;
+        }
+        an_board_local->sched.add(an_gen_square, std::make_shared<an_square>(pin, hz, duty), an_now_us());
+}
+void an_remove_square(const uint8_t pin)
+{
+        an_is_pin_defined(pin);
+        an_board_local->sched.remove(an_gen_square, pin);
+}
+
+// constrain() assigns to its argument, this doesn't
+static inline double an_unit(const double v) {return v < 0 ? 0 : v > 1 ? 1 : v;}
+
+/* Sample n is due at origin + n * period rounded to the microsecond, so fractional
+ * rates don't drift. hold[i] is the number of samples from i on that keep the
+ * value of sample i, stretches of equal samples like the flat parts of a PWM
+ * table are a single event. */
+class an_waveform : public an_source
+{
+public:
+        const an_waveform_t table;
+        std::vector<uint32_t> hold;
+        const double period;
+        const unsigned long long origin;
+        unsigned long long n = 0;
+        std::mutex stats_lock;
+        unsigned long long samples = 0;
+        double late_sum = 0, late_sq = 0, late_max = 0;
+        an_waveform(const uint8_t pin, const an_waveform_t& table, const double rate, const unsigned long long origin)
+                : an_source(pin), table(table), hold(table.size(), 1), period(1000000.0 / rate), origin(origin)
+        {
+                for (size_t i = table.size() - 1; i-- > 0;)
+                        if (table[i] == table[i + 1])
+                                hold[i] = hold[i + 1] + 1;
+        }
+        unsigned long long fire(const unsigned long long t)
+        {
+                const size_t i = n % table.size();
+                an_set_voltage(pin, table[i]);
+#ifndef AN_VIRTUAL_TIME
+                const double late = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - an_board_local->start_time).count() - t * 1000.0;
+#else
+                const double late = 0;
+#endif
+                {
+                        std::lock_guard<std::mutex> guard(stats_lock);
+                        samples++;
+                        late_sum += late;
+                        late_sq += late * late;
+                        late_max = late > late_max ? late : late_max;
+                }
+                n += hold[i];
+                return origin + (unsigned long long)(n * period + 0.5);
+        }
+};
+
+/* Tables are filled in flat loops without dependencies between samples, which
+ * the compiler vectorizes, noise excepted */
+an_waveform_t an_wave_sine(const size_t samples, const float amp, const float dc)
+{
+        an_waveform_t table(samples);
+        const float step = 2.0f * PI / samples;
+        for (size_t i = 0; i < samples; i++)
+                table[i] = dc + amp * sinf(step * i);
+        return table;
+}
+an_waveform_t an_wave_triangle(const size_t samples, const float amp, const float dc)
+{
+        an_waveform_t table(samples);
+        const float step = 1.0f / samples;
+        for (size_t i = 0; i < samples; i++)
+                table[i] = dc + amp * (1.0f - 4.0f * fabsf(step * i - 0.5f));
+        return table;
+}
+an_waveform_t an_wave_saw(const size_t samples, const float amp, const float dc)
+{
+        an_waveform_t table(samples);
+        const float step = 2.0f / samples;
+        for (size_t i = 0; i < samples; i++)
+                table[i] = dc + amp * (step * i - 1.0f);
+        return table;
+}
+an_waveform_t an_wave_pwm(const size_t samples, const float duty, const float high)
+{
+        an_waveform_t table(samples);
+        const size_t on = (size_t)(an_unit(duty) * samples + 0.5f);
+        for (size_t i = 0; i < samples; i++)
+                table[i] = (i < on) * high;
+        return table;
+}
+// uniform noise from xorshift32, the same seed gives the same table
+an_waveform_t an_wave_noise(const size_t samples, const float amp, const float dc, const uint32_t seed)
+{
+        an_waveform_t table(samples);
+        uint32_t x = seed ? seed : 1;
+        for (size_t i = 0; i < samples; i++) {
+                x ^= x << 13;
+                x ^= x >> 17;
+                x ^= x << 5;
+                table[i] = dc + amp * (x / 2147483648.0f - 1.0f);
+        }
+        return table;
+}
+
+void an_attach_waveform(const uint8_t pin, const an_waveform_t& table, const double rate)
+{
+        an_is_pin_defined(pin);
+        if (table.empty() || !(rate > 0)) {
+                an_remove_waveform(pin);
+                return;
+        }
+        const unsigned long long now = an_now_us();
+        an_board_local->sched.add(an_gen_waveform, std::make_shared<an_waveform>(pin, table, rate, now), now);
+}
+void an_remove_waveform(const uint8_t pin)
+{
+        an_is_pin_defined(pin);
+        an_board_local->sched.remove(an_gen_waveform, pin);
+}
+an_jitter_t an_waveform_jitter(const uint8_t pin)
+{
+        an_scheduler& sched = an_board_local->sched;
+        std::shared_ptr<an_source> src;
+        {
+                std::lock_guard<std::mutex> guard(sched.lock);
+                auto pos = sched.sources.find(an_scheduler::key(an_gen_waveform, pin));
+                if (pos != sched.sources.end())
+                        src = pos->second;
+        }
+        an_jitter_t jitter = {};
+        if (!src)
+                return jitter;
+        an_waveform& wave = static_cast<an_waveform&>(*src);
+        std::lock_guard<std::mutex> guard(wave.stats_lock);
+        jitter.samples = wave.samples;
+        if (wave.samples) {
+                jitter.mean_ns = wave.late_sum / wave.samples;
+                jitter.stddev_ns = sqrt(fmax(0.0, wave.late_sq / wave.samples - jitter.mean_ns * jitter.mean_ns));
+                jitter.max_ns = wave.late_max;
+        }
+        return jitter;
+}
+
+/* Toggles the pin of a tone like the timer of the target does. Edge n is at
+ * start plus n half periods, so long notes don't drift from the audio. */
+class an_tone : public an_source
+{
+public:
+        const double half;
+        const unsigned long long start, end;
+        unsigned long long edge = 0;
+        an_tone(const uint8_t pin, const unsigned hz, const unsigned long long start, const unsigned long long end)
+                : an_source(pin), half(500000.0 / hz), start(start), end(end) {}
+        unsigned long long fire(const unsigned long long t)
+        {
+                const uint64_t bit = 1ULL << pin;
+                if (t >= end) {
+                        an_drive_pins(*an_board_local, bit, 0);
+                        return ULLONG_MAX;
+                }
+                an_drive_pins(*an_board_local, bit, edge & 1 ? 0 : bit);
+                edge++;
+                unsigned long long next = start + (unsigned long long)llround(edge * half);
+                return next < end ? next : end;
+        }
+};
+
+// renders the mixer every AN_TONE_BLOCK_US, with virtual time only while tones play
+class an_tone_block : public an_source
+{
+public:
+        an_tone_mixer& mixer;
+        an_tone_block(an_tone_mixer& mixer) : an_source(0), mixer(mixer) {}
+        unsigned long long fire(const unsigned long long t)
+        {
+                std::lock_guard<std::mutex> guard(mixer.lock);
+                mixer.render(t);
+                bool more = mixer.out != nullptr;
+#ifdef AN_VIRTUAL_TIME
+                /* the gap to the next tone is filled with silence when it starts */
+                more = more && !mixer.voices.empty();
+#endif
+                if (more)
+                        return t + AN_TONE_BLOCK_US;
+                mixer.streaming = false;
+                return ULLONG_MAX;
+        }
+};
+
+static void an_wav_u32(uint8_t* p, const uint32_t v)
+{
+        for (unsigned i = 0; i < 4; i++)
+                p[i] = v >> (8 * i);
+}
+static void an_wav_header(uint8_t* h, const uint32_t data_bytes)
+{
+        memcpy(h, "RIFF\0\0\0\0WAVEfmt \x10\0\0\0\x01\0\x01\0", 24);
+        an_wav_u32(h + 4, data_bytes + 36);
+        an_wav_u32(h + 24, AN_TONE_RATE);
+        an_wav_u32(h + 28, AN_TONE_RATE * 2);
+        memcpy(h + 32, "\x02\0\x10\0data", 8);
+        an_wav_u32(h + 40, data_bytes);
+}
+
+bool an_tone_mixer::open(const char* path, const unsigned long long now)
 {
-#ifdef AN_DEBUG_TIMESTAMP
-        std::cout << millis() << "ms | ";
+        close();
+        /* opening a named pipe waits until a player opens the other end */
+        out = fopen(path, "wb");
+        if (!out)
+                return false;
+        seekable = ftell(out) >= 0;
+#ifndef _WIN32
+        /* a player that quits closes the pipe, which should end the stream and not the sketch */
+        if (!seekable)
+                signal(SIGPIPE, SIG_IGN);
 #endif
+        uint8_t header[44];
+        an_wav_header(header, seekable ? 0 : 0xffffffff - 36);
+        fwrite(header, 1, sizeof(header), out);
+        origin = now;
+        samples = 0;
+        return true;
 }
 
-// Digital I/O
-bool digitalRead(uint8_t pin)
+void an_tone_mixer::close()
 {
-        bool res = an_pin_voltage[pin] > 3;
-#ifdef AN_DEBUG_DIGITALREAD
-        an_print_timestamp();
-        std::cout << "Read pin: " << std::to_string(pin) << " is " << (res ? "HIGH\n" : "LOW\n");
-#endif
-        return res;
+        if (!out)
+                return;
+        /* finish the tones that have a duration */
+        unsigned long long last = origin + samples * 1000000ULL / AN_TONE_RATE;
+        for (auto& v : voices)
+                if (v.end != ULLONG_MAX && v.end > last)
+                        last = v.end;
+        render(last);
+        if (seekable) {
+                uint8_t header[44];
+                an_wav_header(header, (uint32_t)(samples * 2));
+                fseek(out, 0, SEEK_SET);
+                fwrite(header, 1, sizeof(header), out);
+        }
+        fclose(out);
+        out = nullptr;
 }
 
-void digitalWrite(uint8_t pin, bool val)
+/* Every voice is a square wave of the same amplitude that is high for the first
+ * half of its period, in phase with the pin. Voices that ended are dropped. */
+void an_tone_mixer::render(const unsigned long long t)
 {
-        an_set_voltage(pin, val * 5.0f);
-#ifdef AN_DEBUG_DIGITALWRITE
-        an_print_timestamp();
-        std::cout << "Pin: " << std::to_string(pin) << " is now " << (val ? "HIGH\n" : "LOW\n");
-#endif
+        const int16_t amp = 8000;
+        const double sample_us = 1000000.0 / AN_TONE_RATE;
+        int16_t buf[1024];
+        size_t n = 0;
+        while (out) {
+                double st = origin + samples * sample_us;
+                if (st >= t)
+                        break;
+                int sum = 0;
+                for (auto& v : voices) {
+                        if (st < v.start || st >= v.end)
+                                continue;
+                        double phase = (st - v.start) * v.hz / 1000000.0;
+                        sum += phase - floor(phase) < 0.5 ? amp : -amp;
+                }
+                buf[n++] = sum > INT16_MAX ? INT16_MAX : sum < INT16_MIN ? INT16_MIN : sum;
+                samples++;
+                if (n == sizeof(buf) / sizeof(buf[0]) || origin + samples * sample_us >= t) {
+                        /* WAV is little endian like the hosts this runs on */
+                        if (fwrite(buf, sizeof(buf[0]), n, out) != n) {
+                                fclose(out);
+                                out = nullptr;
+                        }
+                        n = 0;
+                }
+        }
+        voices.erase(std::remove_if(voices.begin(), voices.end(), [t](const an_voice_t& v) {return v.end <= t;}), voices.end());
 }
 
-void pinMode(uint8_t pin, an_pin_mode_t mode)
+// schedules the block source of the board's mixer when it has an output and isn't running
+void an_tone_schedule(an_board& board, const unsigned long long now)
 {
-        if (mode == INPUT_PULLUP)
-                an_pin_voltage[pin] = 5.0f;
+        bool start;
+        {
+                std::lock_guard<std::mutex> guard(board.tone.lock);
+                start = board.tone.out && !board.tone.streaming;
+                board.tone.streaming |= start;
+        }
+        if (start)
+                board.sched.add(an_gen_tone_mix, std::make_shared<an_tone_block>(board.tone), now + AN_TONE_BLOCK_US);
 }
 
-// Analog I/O
-uint16_t analogRead(uint8_t pin)
+bool an_tone_output(const char* path)
 {
-        an_is_pin_defined(pin);
-        uint16_t val = (uint16_t)lround(map(an_pin_voltage[pin], 0.0f, an_reference_v, 0, 1023));
-        val = constrain(val, 0, 1023);
-#ifdef AN_DEBUG_ANALOGREAD
-        an_print_timestamp();
-        std::cout << "Analog pin: " << std::to_string(pin) << " is " << val << "\n";
-#endif
-        return val;
+        an_board& board = *an_board_local;
+        const unsigned long long now = an_now_us();
+        {
+                std::lock_guard<std::mutex> guard(board.tone.lock);
+                board.tone.close();
+                if (path && !board.tone.open(path, now))
+                        return false;
+        }
+        an_tone_schedule(board, now);
+        return true;
 }
 
-void analogWrite(uint8_t pin, uint8_t val)
+/* Every tone gets its own oscillator, so unlike on the target several pins can play at once */
+void tone(const uint8_t pin, unsigned hz, unsigned long dur)
 {
-        val = constrain(val, 0, 255);
-        an_set_voltage(pin,  map(val, 0, 255, 0.0f, 5.0f));
-#ifdef AN_DEBUG_ANALOGWRITE
-        an_print_timestamp();
-        std::cout << "Duty cycle on pin: " << std::to_string(pin) << " is now " << val << "\n";
+        an_is_pin_defined(pin);
+        if (!hz) {
+                noTone(pin);
+                return;
+        }
+        an_board& board = *an_board_local;
+        an_tone_mixer& mixer = board.tone;
+        const unsigned long long now = an_now_us();
+        const unsigned long long end = dur ? now + dur * 1000ULL : ULLONG_MAX;
+        {
+                std::lock_guard<std::mutex> guard(mixer.lock);
+#ifdef AN_TONE_FILE
+                if (!mixer.opened_default && &board == &an_default_board) {
+                        mixer.opened_default = true;
+                        mixer.open(AN_TONE_FILE, now);
+                }
 #endif
+                mixer.render(now);
+                mixer.voices.erase(std::remove_if(mixer.voices.begin(), mixer.voices.end(), [pin](const an_voice_t& v) {return v.pin == pin;}), mixer.voices.end());
+                mixer.voices.push_back({pin, hz, now, end});
+        }
+        board.sched.add(an_gen_tone, std::make_shared<an_tone>(pin, hz, now, end), now);
+        an_tone_schedule(board, now);
 }
 
-void analogReference(an_reference_t type)
+void noTone(const uint8_t pin)
 {
-        switch(type) {
-        case DEFAULT:
-                an_reference_v = 5.0;
-                break;
-        case INTERNAL:
-                an_reference_v = 1.1;
-                break;
-        case INTERNAL1V1:
-                an_reference_v = 1.1;
-                break;
-        case INTERNAL2V56:
-                an_reference_v = 2.56;
-                break;
-        case EXTERNAL:
-                break;
+        an_is_pin_defined(pin);
+        an_board& board = *an_board_local;
+        {
+                std::lock_guard<std::mutex> guard(board.tone.lock);
+                board.tone.render(an_now_us());
+                board.tone.voices.erase(std::remove_if(board.tone.voices.begin(), board.tone.voices.end(), [pin](const an_voice_t& v) {return v.pin == pin;}), board.tone.voices.end());
         }
+        board.sched.remove(an_gen_tone, pin);
+        an_drive_pins(board, 1ULL << pin, 0);
 }
 
-void an_set_voltage(uint8_t pin, float voltage)
+// Components
+/* Runs wake() of a component at the times it asked for */
+class an_component_timer : public an_source
 {
-        an_is_pin_defined(pin);
-        bool is_on = an_pin_voltage[pin] > 3;
-        bool turn_on = voltage > 3;
-        if (pin == AREF) {
-                an_reference_v = voltage;
-                return;
+public:
+        an_component* const component;
+        an_component_timer(an_component* component) : an_source(0), component(component) {}
+        unsigned long long fire(const unsigned long long t)
+        {
+                std::lock_guard<std::recursive_mutex> guard(component->board->component_lock);
+                /* removed is set under the component lock too when the component is detached */
+                if (!removed)
+                        component->wake(t);
+                return ULLONG_MAX;
         }
+};
 
+void an_notify_components(an_board& board, const uint8_t pin, const float voltage)
+{
+        std::lock_guard<std::recursive_mutex> guard(board.component_lock);
+        const unsigned long long t = an_now_us();
+        for (an_component* component : board.component_watchers[pin])
+                component->changed(pin, voltage, t);
+}
 
-        /* If pin has interrupt attached */
-        if (an_interrupts_enabled && an_ints.find(pin) != an_ints.end())
-                switch(an_ints[pin].mode) {
-                case CHANGE:
-                        if (is_on != turn_on)
-                                an_ints[pin].intpointer();
-                        break;
-                case RISING:
-                        if (!is_on && turn_on)
-                                an_ints[pin].intpointer();
-                        break;
-                case FALLING:
-                        if (is_on && !turn_on)
-                                an_ints[pin].intpointer();
-                        break;
-                }
+void an_attach_component(std::shared_ptr<an_component> component, an_board& board)
+{
+        std::lock_guard<std::recursive_mutex> guard(board.component_lock);
+        component->board = &board;
+        component->timer = std::make_shared<an_component_timer>(component.get());
+        board.components.push_back(component);
+        component->attach();
+}
 
-        an_pin_voltage[pin] = voltage;
+void an_detach_component(std::shared_ptr<an_component> component)
+{
+        an_board& board = *component->board;
+        std::lock_guard<std::recursive_mutex> guard(board.component_lock);
+        for (unsigned pin = 0; pin < AN_MAX_PINS; pin++) {
+                auto& watchers = board.component_watchers[pin];
+                watchers.erase(std::remove(watchers.begin(), watchers.end(), component.get()), watchers.end());
+                if (watchers.empty())
+                        board.component_watch.fetch_and(~(1ULL << pin));
+        }
+        {
+                std::lock_guard<std::mutex> sched_guard(board.sched.lock);
+                component->timer->removed = true;
+        }
+        board.components.erase(std::remove(board.components.begin(), board.components.end(), component), board.components.end());
 }
 
-void an_request_voltage(uint8_t pin)
+void an_component::watch(const uint8_t pin)
 {
-        std::cout << "set voltage of pin " << std::to_string(pin) << " to: ";
-        float voltage;
-        std::cin >> voltage;
+        an_is_pin_defined(pin);
+        auto guard = hold();
+        board->component_watchers[pin].push_back(this);
+        board->component_watch.fetch_or(1ULL << pin);
+}
+void an_component::wake_at(const unsigned long long t)
+{
+        board->sched.post(timer, t);
+}
+/* pins are driven on the component's board whichever thread calls this */
+void an_component::drive(const uint8_t pin, const float voltage)
+{
+        an_board* prev = an_board_local;
+        an_board_local = board;
         an_set_voltage(pin, voltage);
+        an_board_local = prev;
 }
-
-// Time
-void delay(unsigned long ms)
+float an_component::voltage(const uint8_t pin)
 {
-        std::this_thread::sleep_for(std::chrono::milliseconds(ms));
+        return board->pins.get(pin);
 }
-void delayMicroseconds(unsigned long micros)
+unsigned long long an_component::now()
+{
+#ifdef AN_VIRTUAL_TIME
+        return board->virtual_us.load();
+#else
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - board->start_time).count();
+#endif
+}
+std::unique_lock<std::recursive_mutex> an_component::hold()
 {
-        std::this_thread::sleep_for(std::chrono::microseconds(micros));
+        return std::unique_lock<std::recursive_mutex>(board->component_lock);
 }
 
-unsigned long micros()
+void an_button::attach()
 {
-        auto duration = std::chrono::system_clock::now().time_since_epoch();
-        return (unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(duration).count() - an_start_time_micros;
+        rng ^= pin;
+        drive(pin, level(false));
 }
-unsigned long millis()
+/* The contacts close (or open) at once and then bounce at random intervals
+ * that add up to about bounce_us, ending at the new level */
+void an_button::set(const bool closed)
 {
-        auto duration = std::chrono::system_clock::now().time_since_epoch();
-        return (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(duration).count() - an_start_time_ms;
+        auto guard = hold();
+        if (closed == pressed)
+                return;
+        pressed = closed;
+        drive(pin, level(closed));
+        bounces_left = bounces;
+        if (!bounces_left)
+                return;
+        next_bounce = now() + 1;
+        wake_at(next_bounce);
+}
+void an_button::wake(const unsigned long long t)
+{
+        /* a press or release that came since made this wake-up stale */
+        if (t != next_bounce || !bounces_left)
+                return;
+        bounces_left--;
+        drive(pin, level(bounces_left & 1 ? !pressed : pressed));
+        if (!bounces_left)
+                return;
+        rng ^= rng << 13;
+        rng ^= rng >> 17;
+        rng ^= rng << 5;
+        unsigned long gap = bounce_us / bounces;
+        next_bounce = t + 1 + gap / 2 + rng % (gap + 1);
+        wake_at(next_bounce);
 }
 
-// Random Numbers
-long random(long max) {return rand() % max;}
-long random(long min, long max) {return min + rand() % (max - min);}
-void randomSeed(long seed) {srand(seed);}
-
-// External Interrupts
-void attachInterrupt(uint8_t pin, void (*intpointer)(), an_int_mode_t mode)
+void an_potentiometer::attach()
+{
+        drive(pin, to * vcc);
+}
+void an_potentiometer::set(const float position)
+{
+        auto guard = hold();
+        from = to = an_unit(position);
+        sweep_end = 0;
+        drive(pin, to * vcc);
+}
+void an_potentiometer::sweep(const float position, const unsigned long ms)
+{
+        auto guard = hold();
+        from = this->position();
+        to = an_unit(position);
+        sweep_start = now();
+        sweep_end = sweep_start + ms * 1000ULL;
+        wake_at(sweep_start);
+}
+float an_potentiometer::position()
 {
-        detachInterrupt(pin);
-        an_ints[pin] = {intpointer, mode};
+        auto guard = hold();
+        unsigned long long t = now();
+        if (t >= sweep_end)
+                return to;
+        return from + (to - from) * (float)(t - sweep_start) / (float)(sweep_end - sweep_start);
 }
-void  detachInterrupt(const uint8_t pin)
+void an_potentiometer::wake(const unsigned long long t)
 {
-        an_is_pin_defined(pin, an_int_pin);
-        auto int_pos = an_ints.find(pin);
-        if (int_pos != an_ints.end())
-                an_ints.erase(int_pos);
+        if (!sweep_end)
+                return;
+        if (t >= sweep_end) {
+                drive(pin, to * vcc);
+                sweep_end = 0;
+                return;
+        }
+        drive(pin, (from + (to - from) * (float)(t - sweep_start) / (float)(sweep_end - sweep_start)) * vcc);
+        wake_at(t + AN_SINE_STEP_US < sweep_end ? t + AN_SINE_STEP_US : sweep_end);
 }
-void interrupts() {an_interrupts_enabled = true;}
-void noInterrupts() {an_interrupts_enabled = false;}
 
-// Advanced I/O
-inline void noTone(const uint8_t pin)
+float an_rc_filter::at(const unsigned long long t) const
 {
-        an_is_pin_defined(pin);
-#ifndef _WIN32
-        system("killall \"ffplay\" -q");
-#endif
+        return target_v + (start_v - target_v) * (float)exp(-(double)(t - start_t) / tau_us);
 }
-unsigned long pulseIn(const uint8_t pin, const bool val, const unsigned long timeout)
+void an_rc_filter::attach()
 {
-        an_is_pin_defined(pin);
-        while (digitalRead(pin) != val);
-        unsigned long before = micros();
-        while (digitalRead(pin) == val && (!timeout && micros() - before >= timeout));
-        unsigned long after = micros();
-        return after - before;
+        watch(in_pin);
+        start_t = now();
+        start_v = voltage(out_pin);
+        target_v = voltage(in_pin);
+        next_step = start_t;
+        wake_at(next_step);
 }
-inline unsigned long pulseInLong(const uint8_t pin, const bool val, const unsigned long timeout)
+void an_rc_filter::changed(const uint8_t pin, const float voltage, const unsigned long long t)
 {
-        return pulseIn(pin, val, timeout);
+        start_v = at(t);
+        start_t = t;
+        target_v = voltage;
+        /* restart stepping from the change, pending steps become stale */
+        next_step = t;
+        wake_at(next_step);
 }
-uint8_t shiftIn(const uint8_t data_pin, const uint8_t clock_pin, const uint8_t bit_order)
+void an_rc_filter::wake(const unsigned long long t)
 {
-        an_is_pin_defined(data_pin);
-        an_is_pin_defined(clock_pin);
-
-        uint8_t value = 0;
-        uint8_t i;
+        if (t != next_step)
+                return;
+        float v = at(t);
+        /* settled, the output stays put until the input changes again */
+        if (fabs(v - target_v) < 0.001f) {
+                drive(out_pin, target_v);
+                return;
+        }
+        drive(out_pin, v);
+        unsigned long long step = (unsigned long long)(tau_us / 8);
+        next_step = t + (step ? step : 1);
+        wake_at(next_step);
+}
 
-        for (i = 0; i < 8; ++i) {
-                digitalWrite(clock_pin, HIGH);
-                if (bit_order == LSBFIRST)
-                        value |= digitalRead(data_pin) << i;
-                else
-                        value |= digitalRead(data_pin) << (7 - i);
-                digitalWrite(clock_pin, LOW);
+void an_hcsr04::attach()
+{
+        watch(trig_pin);
+        drive(echo_pin, 0.0f);
+}
+void an_hcsr04::changed(const uint8_t pin, const float voltage, const unsigned long long t)
+{
+        if (voltage > 3) {
+                trig_rise = t;
+                return;
         }
-        return value;
+        /* a measurement in progress ignores triggers, like the sensor does */
+        if (trig_rise == ULLONG_MAX || t - trig_rise < 10 || echo_fall > t) {
+                trig_rise = ULLONG_MAX;
+                return;
+        }
+        trig_rise = ULLONG_MAX;
+        unsigned long long width = cm >= 2.0f && cm <= 400.0f ? (unsigned long long)llround(cm * 58.0f) : 38000;
+        echo_rise = t + 250;
+        echo_fall = echo_rise + width;
+        wake_at(echo_rise);
+        wake_at(echo_fall);
 }
-void shiftOut(const uint8_t data_pin, const uint8_t clock_pin, const bool bit_order, byte val)
+void an_hcsr04::wake(const unsigned long long t)
 {
-        an_is_pin_defined(data_pin);
-        an_is_pin_defined(clock_pin);
-
-        uint8_t i;
-
-        for (i = 0; i < 8; i++)  {
-                if (bit_order == LSBFIRST) {
-                        digitalWrite(data_pin, val & 1);
-                        val >>= 1;
-                } else {
-                        digitalWrite(data_pin, (val & 128) != 0);
-                        val <<= 1;
-                }
+        if (t == echo_rise)
+                drive(echo_pin, 5.0f);
+        else if (t == echo_fall)
+                drive(echo_pin, 0.0f);
+}
 
-                digitalWrite(clock_pin, HIGH);
-                digitalWrite(clock_pin, LOW);
-        }
+void an_led::advance(const unsigned long long t)
+{
+        if (t <= since)
+                return;
+        double dt = t - since;
+        on_total += level * dt;
+        smoothed = level + (smoothed - level) * exp(-dt / persistence_us);
+        since = t;
 }
-void tone(const uint8_t pin, unsigned hz, unsigned long dur)
+void an_led::attach()
 {
-        noTone(pin);
-#ifndef _WIN32
-        hz = constrain(hz, 0, 20000);
-        char ffplay[70];
-        snprintf(ffplay, sizeof(ffplay), "ffplay -f lavfi -i \"sine=frequency=%d\" -nodisp -loglevel quiet &", hz);
-        system(ffplay);
-#endif
+        watch(pin);
+        since = attached_at = now();
+        level = an_unit(voltage(pin) / 5.0);
 }
-void an_play_sine(const uint8_t pin, const unsigned hz, const float amp, const float dc)
+void an_led::changed(const uint8_t pin, const float voltage, const unsigned long long t)
 {
-        for (;;) {
-                if (an_sines_terminate[pin])
-                        return;
-                an_set_voltage(pin, sin(((float)millis() / (1000.0f / (2.0f * PI))) * hz) * amp + dc);
-        }
+        advance(t);
+        level = an_unit(voltage / 5.0);
 }
-void an_play_sine_abs(const uint8_t pin, const unsigned hz, const float amp, const float dc)
+float an_led::brightness()
 {
-        for (;;) {
-                if (an_sines_terminate[pin])
-                        return;
-                an_set_voltage(pin, fabs(sin(((float)millis() / (1000.0f / (2.0f * PI))) * hz) * amp + dc));
-        }
+        auto guard = hold();
+        advance(now());
+        return smoothed;
+}
+float an_led::duty()
+{
+        auto guard = hold();
+        advance(now());
+        return since > attached_at ? on_total / (since - attached_at) : level;
 }
 
-void an_attach_sine(const uint8_t pin, const unsigned hz, const float amp, const float dc, const bool is_abs)
+/* Plays a recorded capture onto pins. The file is memory mapped and parsed a
+ * record at a time as playback reaches it, pages that have been played are
+ * released again so captures don't have to fit in memory.
+ * CSV lines are "time,pin,voltage" with time scaled by time_scale to microseconds,
+ * VCD signals are mapped to the pin number at the end of their name (A<n> for analog pins). */
+class an_stimulus : public an_source
 {
-        an_remove_sine(pin);
-        an_sines_terminate[pin] = false;
-        if (is_abs) {
-                std::thread sine(an_play_sine_abs, pin, hz, amp, dc);
-                an_sines[pin] = move(sine);
-        } else {
-                std::thread sine(an_play_sine, pin, hz, amp, dc);
-                an_sines[pin] = move(sine);
+private:
+        const char* data = nullptr;
+        size_t size = 0;
+        size_t pos = 0;
+        size_t released = 0;
+        std::vector<char> owned;
+        bool is_vcd = false;
+        double time_scale;
+        double vcd_scale = 1.0;
+        unsigned long long start;
+        unsigned long long vcd_time = 0;
+        std::unordered_map<std::string, uint8_t> vcd_pins;
+        /* next record to apply */
+        unsigned long long next_t = 0;
+        uint8_t next_pin = 0;
+        float next_v = 0.0f;
+        bool warned = false;
+
+        inline bool at_space() {return pos < size && isspace((unsigned char)data[pos]);}
+        std::string token()
+        {
+                while (at_space())
+                        pos++;
+                size_t begin = pos;
+                while (pos < size && !isspace((unsigned char)data[pos]))
+                        pos++;
+                return std::string(data + begin, pos - begin);
+        }
+        /* Pin of the board that name ends in, -1 if there's no number or the board
+         * doesn't have that pin. Records for pins it doesn't have are skipped with a
+         * warning, once per stimulus. */
+        int pin_from_name(const std::string& name)
+        {
+                size_t digits = name.find_last_not_of("0123456789") + 1;
+                if (digits >= name.length())
+                        return -1;
+                int n = 0;
+                if (std::from_chars(name.data() + digits, name.data() + name.length(), n).ec != std::errc())
+                        n = INT_MAX;
+                if (n < AN_MAX_PINS && digits > 0 && (name[digits - 1] == 'A' || name[digits - 1] == 'a'))
+                        n += A0;
+                if (n < AN_MAX_PINS)
+                        return n;
+                if (!warned)
+                        std::cerr << "WARNING: STIMULUS RECORDS FOR " << name << " ARE SKIPPED, " << AN_BOARD_NAME << " HAS NO SUCH PIN\n";
+                warned = true;
+                return -1;
+        }
+        void release()
+        {
+#ifndef _WIN32
+                /* give back pages that have been played */
+                const size_t chunk = 64 << 20;
+                if (owned.empty() && pos - released >= chunk) {
+                        size_t page = sysconf(_SC_PAGESIZE);
+                        size_t end = (pos / page) * page;
+                        madvise((void*)(data + released), end - released, MADV_DONTNEED);
+                        released = end;
+                }
+#endif
+        }
+        bool parse_csv()
+        {
+                while (pos < size) {
+                        size_t eol = pos;
+                        while (eol < size && data[eol] != '\n')
+                                eol++;
+                        const char* line = data + pos;
+                        const char* end = data + eol;
+                        pos = eol + 1;
+                        double t;
+                        float v;
+                        auto res = std::from_chars(line, end, t);
+                        if (res.ec != std::errc() || res.ptr == end || *res.ptr != ',')
+                                continue; // header or empty line
+                        const char* field = res.ptr + 1;
+                        while (field < end && isspace((unsigned char)*field))
+                                field++;
+                        const char* pin_end = field;
+                        while (pin_end < end && *pin_end != ',')
+                                pin_end++;
+                        int pin = pin_from_name(std::string(field, pin_end - field));
+                        if (pin < 0 || pin_end == end)
+                                continue;
+                        field = pin_end + 1;
+                        while (field < end && isspace((unsigned char)*field))
+                                field++;
+                        if (std::from_chars(field, end, v).ec != std::errc())
+                                continue;
+                        next_t = start + (unsigned long long)llround(t * time_scale);
+                        next_pin = pin;
+                        next_v = v;
+                        return true;
+                }
+                return false;
+        }
+        void parse_vcd_header()
+        {
+                static const std::pair<const char*, double> units[] = {
+                        {"s", 1e6}, {"ms", 1e3}, {"us", 1.0}, {"ns", 1e-3}, {"ps", 1e-6}, {"fs", 1e-9},
+                };
+                while (pos < size) {
+                        std::string tok = token();
+                        if (tok == "$enddefinitions") {
+                                token();
+                                return;
+                        } else if (tok == "$timescale") {
+                                std::string scale = token();
+                                if (scale.find_first_not_of("0123456789") == std::string::npos)
+                                        scale += token();
+                                double mult = atof(scale.c_str());
+                                const size_t unit = scale.find_first_not_of("0123456789");
+                                for (auto& u : units)
+                                        if (unit != std::string::npos && scale.compare(unit, std::string::npos, u.first) == 0)
+                                                vcd_scale = mult * u.second;
+                        } else if (tok == "$var") {
+                                token(); // type
+                                token(); // size
+                                std::string id = token();
+                                int pin = pin_from_name(token());
+                                if (pin >= 0)
+                                        vcd_pins[id] = pin;
+                        }
+                }
+        }
+        bool parse_vcd()
+        {
+                while (pos < size) {
+                        std::string tok = token();
+                        if (tok.empty())
+                                break;
+                        std::string id;
+                        float v;
+                        switch (tok[0]) {
+                        case '#':
+                                vcd_time = strtoull(tok.c_str() + 1, nullptr, 10);
+                                continue;
+                        case '$':
+                                /* $dumpvars and friends wrap normal value changes */
+                                continue;
+                        case '0':
+                        case '1':
+                                id = tok.substr(1);
+                                v = tok[0] == '1' ? 5.0f : 0.0f;
+                                break;
+                        case 'b':
+                        case 'B':
+                                id = token();
+                                v = tok.find('1') != std::string::npos ? 5.0f : 0.0f;
+                                break;
+                        case 'r':
+                        case 'R':
+                                id = token();
+                                v = atof(tok.c_str() + 1);
+                                break;
+                        default:
+                                /* x, z and unknown values */
+                                continue;
+                        }
+                        auto pin = vcd_pins.find(id);
+                        if (pin == vcd_pins.end())
+                                continue;
+                        next_t = start + (unsigned long long)llround(vcd_time * vcd_scale);
+                        next_pin = pin->second;
+                        next_v = v;
+                        return true;
+                }
+                return false;
+        }
+        inline bool parse_next()
+        {
+                release();
+                return is_vcd ? parse_vcd() : parse_csv();
+        }
+public:
+        an_stimulus(const unsigned id, const double time_scale, const unsigned long long start)
+                : an_source(0, id), time_scale(time_scale), start(start) {}
+        ~an_stimulus()
+        {
+#ifndef _WIN32
+                if (owned.empty() && data)
+                        munmap((void*)data, size);
+#endif
         }
+        bool open(const char* path)
+        {
+#ifndef _WIN32
+                int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+                if (fd < 0)
+                        return false;
+                struct stat st = {};
+                if (fstat(fd, &st) == 0 && st.st_size > 0) {
+                        void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+                        if (map != MAP_FAILED) {
+                                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                                data = (const char*)map;
+                                size = st.st_size;
+                        }
+                }
+                close(fd);
+                if (!data && st.st_size > 0)
+                        return false;
+#else
+                FILE* file = fopen(path, "rb");
+                if (!file)
+                        return false;
+                char buf[65536];
+                for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) > 0;)
+                        owned.insert(owned.end(), buf, buf + n);
+                fclose(file);
+                data = owned.data();
+                size = owned.size();
+#endif
+                size_t first = 0;
+                while (first < size && isspace((unsigned char)data[first]))
+                        first++;
+                is_vcd = first < size && data[first] == '$';
+                if (is_vcd)
+                        parse_vcd_header();
+                return true;
+        }
+        unsigned long long first()
+        {
+                return parse_next() ? next_t : ULLONG_MAX;
+        }
+        unsigned long long fire(const unsigned long long t)
+        {
+                do {
+                        an_set_voltage(next_pin, next_v);
+                        if (!parse_next())
+                                return ULLONG_MAX;
+                } while (next_t <= t);
+                return next_t;
+        }
+};
+
+int an_play_stimulus(const char* path, const double time_scale)
+{
+        static std::atomic<unsigned> an_stimulus_count{0};
+        /* ids stay apart for 2^31 plays, -1 is left for errors */
+        const int id = an_stimulus_count++ & INT_MAX;
+        unsigned long long now = an_now_us();
+        auto stimulus = std::make_shared<an_stimulus>(id, time_scale, now);
+        if (!stimulus->open(path))
+                return -1;
+        unsigned long long first = stimulus->first();
+        if (first == ULLONG_MAX)
+                return id;
+        an_board_local->sched.add(an_gen_stimulus, stimulus, first);
+        return id;
 }
-void an_remove_sine(const uint8_t pin)
+void an_stop_stimulus(const int id)
 {
-        an_is_pin_defined(pin);
-        auto sine_pos = an_sines.find(pin);
-        if (sine_pos != an_sines.end()) {
-                an_sines_terminate[pin] = true;
-                an_sines[pin].join();
-                an_sines.erase(sine_pos);
-        }
+        an_board_local->sched.remove(an_gen_stimulus, id);
 }
 
-void an_play_square(const uint8_t pin, const unsigned hz, const float duty)
+#ifdef AN_FUZZ
+/* Plays the input of the fuzzer on the default board. Every step starts with an
+ * opcode byte, steps that are cut short by the end of the input are dropped:
+ *   0 + port << 2, length, bytes  Serial bytes
+ *   1, pin, level                  voltage of level * 5 / 255 on pin % AN_MAX_PINS
+ *   2, us                          wait us microseconds
+ *   3, ms                          wait ms milliseconds
+ * Steps between two waits happen at the same time. */
+class an_fuzz_input : public an_source
 {
-        bool top = true;
-        for (;;) {
-                if (an_sines_terminate[pin])
-                        return;
-                float sine = sin((millis() / (1000.0f / (2.0f * PI))) * hz);
-                float triangle = 1.0f-acos(sine)/PI;
+private:
+        const uint8_t* data;
+        const size_t size;
+        size_t pos = 0;
+        unsigned long long next_t = 0;
 
-                float new_top = triangle <= duty;
-                if (new_top != top) {
-                        an_set_voltage(pin, new_top * 5.0f);
-                        top = new_top;
+        static an_serial* port(const uint8_t n)
+        {
+#ifdef AN_TEENSY_41
+                an_serial* ports[] = {&an_default_board.serial, &an_default_board.serial1, &an_default_board.serial2};
+                return ports[n % 3];
+#else
+                (void)n;
+                return &an_default_board.serial;
+#endif
+        }
+        /* skips the waits in front of the next step, false at the end of the input
+         * or when the end cuts the next step short */
+        bool wait()
+        {
+                while (pos + 1 < size && (data[pos] & 3) >= 2) {
+                        next_t += (data[pos] & 3) == 2 ? data[pos + 1] : data[pos + 1] * 1000ULL;
+                        pos += 2;
                 }
+                if (pos + 1 >= size)
+                        return false;
+                return (data[pos] & 3) == 0 ? pos + 2 + data[pos + 1] <= size : pos + 3 <= size;
         }
-}
+        void step()
+        {
+                const uint8_t op = data[pos];
+                if ((op & 3) == 0) {
+                        const size_t len = data[pos + 1];
+                        port(op >> 2)->an_receive(data + pos + 2, len);
+                        pos += 2 + len;
+                        return;
+                }
+                const uint8_t pin = data[pos + 1] % AN_MAX_PINS;
+                if (an_pin_caps.has(pin, an_digital) || an_pin_caps.has(pin, an_analog))
+                        an_apply_voltage(pin, data[pos + 2] * 5.0f / 255.0f);
+                pos += 3;
+        }
+public:
+        an_fuzz_input(const uint8_t* data, const size_t size) : an_source(0), data(data), size(size) {}
+        unsigned long long first()
+        {
+                return wait() ? next_t : ULLONG_MAX;
+        }
+        unsigned long long fire(const unsigned long long t)
+        {
+                while (next_t <= t) {
+                        step();
+                        if (!wait()) {
+                                /* let the sketch react to the last input, then stop */
+                                an_board& board = *an_board_local;
+                                if (board.max_loops > board.loops + AN_FUZZ_SETTLE_LOOPS)
+                                        board.max_loops = board.loops + AN_FUZZ_SETTLE_LOOPS;
+                                return ULLONG_MAX;
+                        }
+                }
+                return next_t;
+        }
+};
 
-void an_attach_square(const uint8_t pin, const unsigned hz, const float duty)
+// globals of the sketch are its own business
+void an_fuzz_reset()
 {
-        an_remove_square(pin);
-        an_squares_terminate[pin] = false;
-        std::thread square(an_play_square, pin, hz, duty);
-        an_squares[pin] = move(square);
+        an_default_board.reset();
+        srand(1);
 }
-void an_remove_square(const uint8_t pin)
+
+extern "C" int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
 {
-        an_is_pin_defined(pin);
-        auto square_pos = an_squares.find(pin);
-        if (square_pos != an_squares.end()) {
-                an_squares_terminate[pin] = true;
-                an_squares[pin].join();
-                an_squares.erase(square_pos);
-        }
+        an_fuzz_reset();
+        an_board& board = an_default_board;
+        board.setup_fn = setup;
+        board.loop_fn = loop;
+        board.max_loops = AN_FUZZ_LOOPS;
+        auto input = std::make_shared<an_fuzz_input>(data, size);
+        const unsigned long long first = input->first();
+        if (first != ULLONG_MAX)
+                board.sched.add(an_gen_fuzz, input, first);
+        board.run();
+        return 0;
 }
+#endif
 #undef AN_IMPL
 #endif // AN_IMPL
 
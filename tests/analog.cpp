@@ -0,0 +1,41 @@
+// analogRead() and analogWrite() on the Uno, with channel numbers, pins without PWM and AREF
+#define AN_VIRTUAL_TIME
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+int main()
+{
+        an_set_voltage(A0, 2.5f);
+        CHECK_EQ(analogRead(A0), 512);
+        CHECK_EQ(analogRead(0), 512);
+        an_set_voltage(A5, 5.0f);
+        CHECK_EQ(analogRead(5), 1023);
+        CHECK_EQ(analogRead<A5>(), 1023);
+
+        /* a reference of 2.5 V doubles the code */
+        an_set_voltage(A0, 1.25f);
+        an_set_voltage(AREF, 2.5f);
+        CHECK_EQ(analogRead(A0), 512);
+        an_set_voltage(AREF, 5.0f);
+
+        uint16_t block[4];
+        an_analog_read_block(0, block, 4);
+        CHECK_EQ(block[3], 256);
+
+        /* pin 3 has PWM, pin 4 doesn't and is written HIGH from 128 on */
+        analogWrite(3, 255);
+        CHECK(an_current_board().pins.get(3) > 4.9f);
+        analogWrite(4, 200);
+        CHECK(digitalRead(4));
+        analogWrite(4, 127);
+        CHECK(!digitalRead(4));
+
+        /* pins that don't exist stop the sketch, AREF isn't a pin of the bank */
+        CHECK_EXITS(analogRead(AREF));
+        CHECK_EXITS(digitalRead(AREF));
+        CHECK_EXITS(analogRead(6));
+        CHECK_EXITS(analogWrite(20, 1));
+        return an_check_result();
+}
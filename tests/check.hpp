@@ -0,0 +1,65 @@
+/* Checks for the tests. A failed check prints where it failed, and main() returns
+ * an_check_result() so the test exits with 1 if any check failed. */
+#ifndef AN_CHECK_H_
+#define AN_CHECK_H_
+
+#include <cstdio>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static int an_check_failures = 0;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+                fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+                an_check_failures++; \
+        } \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+        auto an_a = (a); \
+        auto an_b = (b); \
+        if (!(an_a == an_b)) { \
+                fprintf(stderr, "%s:%d: CHECK_EQ(%s, %s) failed: %s != %s\n", __FILE__, __LINE__, #a, #b, \
+                        std::to_string(an_a).c_str(), std::to_string(an_b).c_str()); \
+                an_check_failures++; \
+        } \
+} while (0)
+
+/* Runs stmt in a child process and checks that it stops the sketch with exit(1),
+ * the error it prints is kept out of the output of the test */
+#define CHECK_EXITS(stmt) do { \
+        fflush(stdout); \
+        pid_t an_pid = fork(); \
+        if (an_pid == 0) { \
+                freopen("/dev/null", "w", stdout); \
+                stmt; \
+                _exit(0); \
+        } \
+        int an_status = 0; \
+        waitpid(an_pid, &an_status, 0); \
+        if (!WIFEXITED(an_status) || WEXITSTATUS(an_status) != 1) { \
+                fprintf(stderr, "%s:%d: CHECK_EXITS(%s) failed\n", __FILE__, __LINE__, #stmt); \
+                an_check_failures++; \
+        } \
+} while (0)
+
+/* Runs body as the setup() of the default board, so ISRs, edge waits and safe
+ * points work like in a sketch */
+inline void an_check_on_board(void (*body)())
+{
+        an_board& board = an_default_board;
+        board.setup_fn = body;
+        board.loop_fn = [] {};
+        board.max_loops = 1;
+        board.run();
+}
+
+inline int an_check_result()
+{
+        if (an_check_failures)
+                fprintf(stderr, "%d checks failed\n", an_check_failures);
+        return an_check_failures ? 1 : 0;
+}
+
+#endif // AN_CHECK_H_
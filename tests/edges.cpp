@@ -0,0 +1,41 @@
+// edge waits and pulseIn() in virtual time, with and without anything scheduled
+#define AN_VIRTUAL_TIME
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+void test()
+{
+        /* nothing can change the pin, so waits without timeout return */
+        CHECK(!an_wait_for_edge(2, RISING));
+        CHECK_EQ(pulseIn(2, HIGH, 0), 0ul);
+        CHECK(an_wait_for_edge(2, AN_INT_LOW));
+
+        /* a timeout moves the clock to the deadline */
+        unsigned long start = micros();
+        CHECK(!an_wait_for_edge(2, RISING, 300));
+        CHECK_EQ(micros() - start, 300ul);
+
+        /* edges of a 1 kHz square, 500 us high */
+        an_attach_square(2, 1000);
+        unsigned long long fell = 0, rose = 0;
+        CHECK(an_wait_for_edge(2, FALLING, 0, &fell));
+        CHECK(an_wait_for_edge(2, RISING, 0, &rose));
+        CHECK_EQ(rose - fell, 500ull);
+        CHECK(an_wait_for_edge(2, CHANGE, 0, &fell));
+        CHECK_EQ(fell - rose, 500ull);
+        CHECK_EQ(pulseIn(2, HIGH), 500ul);
+        CHECK_EQ(pulseIn(2, LOW, 0), 500ul);
+
+        /* a pulse shorter than the timeout, and a timeout shorter than the pulse */
+        CHECK_EQ(pulseIn(2, HIGH, 2000), 500ul);
+        CHECK_EQ(pulseIn(2, HIGH, 100), 0ul);
+        an_remove_square(2);
+}
+
+int main()
+{
+        an_check_on_board(test);
+        return an_check_result();
+}
@@ -0,0 +1,67 @@
+// the fuzz input decoder and the board reset between runs
+#define AN_FUZZ
+#define AN_STRING_HEAP 4096
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+std::string received;
+String kept;
+int rises;
+void on_rise() {rises++;}
+
+void setup()
+{
+        received.clear();
+        rises = 0;
+        kept = "a String that outlives the run";
+        attachInterrupt(digitalPinToInterrupt(2), on_rise, RISING);
+}
+void loop()
+{
+        while (Serial.available())
+                received += (char)Serial.read();
+        delay(1);
+}
+
+template <size_t n>
+static void run(const uint8_t (&input)[n])
+{
+        LLVMFuzzerTestOneInput(input, n);
+}
+
+int main()
+{
+        an_board& board = an_default_board;
+
+        const uint8_t serial[] = {0, 2, 'h', 'i', 2, 100, 0, 1, '!'};
+        run(serial);
+        CHECK(received == "hi!");
+        CHECK(board.virtual_us >= 100u);
+
+        /* a step cut short by the end of the input is dropped as a whole */
+        const uint8_t short_serial[] = {0, 2, 'o', 'k', 0, 5, 'c', 'u', 't'};
+        run(short_serial);
+        CHECK(received == "ok");
+        const uint8_t short_pin[] = {1, 2, 255, 3, 1, 1, 3};
+        run(short_pin);
+        CHECK_EQ(rises, 1);
+        CHECK_EQ(board.pins.get(3), 0.0f);
+
+        /* every run starts from the same board */
+        const uint8_t pins[] = {1, 2, 255, 2, 10, 1, 2, 0, 2, 10, 1, 2, 255};
+        run(pins);
+        const unsigned long long took = board.virtual_us;
+        CHECK_EQ(rises, 2);
+        run(pins);
+        CHECK_EQ(rises, 2);
+        CHECK_EQ(board.virtual_us.load(), took);
+        CHECK_EQ(board.serial.available(), 0);
+
+        /* the global String is counted once whatever the number of runs */
+        const size_t heap = board.string_heap;
+        CHECK(heap > 0);
+        run(pins);
+        CHECK_EQ(board.string_heap.load(), heap);
+        return an_check_result();
+}
@@ -0,0 +1,47 @@
+// square and sine generators on the scheduler, in virtual time
+#define AN_VIRTUAL_TIME
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+unsigned changes;
+void on_change() {changes++;}
+
+void test()
+{
+        an_board& board = an_current_board();
+
+        /* 3 Hz doesn't divide a second evenly, no edge may be lost to rounding */
+        attachInterrupt(digitalPinToInterrupt(2), on_change, CHANGE);
+        an_attach_square(2, 3);
+        delay(2000);
+        CHECK_EQ(changes, 12u);
+
+        /* 0 Hz holds the pin LOW and schedules nothing */
+        an_attach_square(2, 0);
+        CHECK_EQ(board.pins.get(2), 0.0f);
+        CHECK(!board.sched.sources.count(an_scheduler::key(an_gen_square, 2)));
+        const unsigned before = changes;
+        delay(1000);
+        CHECK(changes <= before + 1);
+        CHECK_EQ(board.pins.get(2), 0.0f);
+
+        /* a 1 Hz sine of 2.5 V around 2.5 V peaks a quarter period in */
+        const unsigned long start = millis();
+        an_attach_sine(A0, 1, 2.5f, 2.5f);
+        delay(250 - (millis() - start));
+        CHECK(board.pins.get(A0) > 4.9f);
+        delay(500);
+        CHECK(board.pins.get(A0) < 0.1f);
+        an_remove_sine(A0);
+        const float held = board.pins.get(A0);
+        delay(300);
+        CHECK_EQ(board.pins.get(A0), held);
+}
+
+int main()
+{
+        an_check_on_board(test);
+        return an_check_result();
+}
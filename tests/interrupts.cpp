@@ -0,0 +1,57 @@
+// interrupt numbers, the interrupt mask and LOW/HIGH modes on the Uno
+#define AN_VIRTUAL_TIME
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+int rising, low;
+void on_rising() {rising++;}
+void on_low() {low++;}
+
+void test()
+{
+        an_board& board = an_current_board();
+        CHECK_EQ(digitalPinToInterrupt(2), 0);
+        CHECK_EQ(digitalPinToInterrupt(3), 1);
+        CHECK_EQ(digitalPinToInterrupt(4), NOT_AN_INTERRUPT);
+
+        /* the common attachInterrupt(0, ...) is pin 2 */
+        attachInterrupt(0, on_rising, RISING);
+        CHECK_EQ(board.int_mask.load(), 1ULL << 2);
+        an_set_voltage(2, 5.0f);
+        delay(1);
+        an_set_voltage(2, 0.0f);
+        delay(1);
+        CHECK_EQ(rising, 1);
+
+        /* interrupts the board doesn't have are ignored */
+        attachInterrupt(digitalPinToInterrupt(4), on_rising, RISING);
+        attachInterrupt(5, on_rising, RISING);
+        detachInterrupt(7);
+        CHECK_EQ(board.int_mask.load(), 1ULL << 2);
+
+        detachInterrupt(digitalPinToInterrupt(2));
+        CHECK_EQ(board.int_mask.load(), 0ULL);
+        an_set_voltage(2, 5.0f);
+        delay(1);
+        CHECK_EQ(rising, 1);
+
+        /* a LOW interrupt runs again while the pin stays low */
+        attachInterrupt(digitalPinToInterrupt(3), on_low, LOW);
+        CHECK_EQ(board.int_level_mask.load(), 1ULL << 3);
+        delay(1);
+        delay(1);
+        CHECK(low >= 2);
+        an_set_voltage(3, 5.0f);
+        delay(1);
+        const int seen = low;
+        delay(1);
+        CHECK_EQ(low, seen);
+}
+
+int main()
+{
+        an_check_on_board(test);
+        return an_check_result();
+}
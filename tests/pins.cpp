@@ -0,0 +1,70 @@
+// snapshots of the pin bank stay consistent and don't wait on writes of their own thread
+#define AN_VIRTUAL_TIME
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+/* shift register that samples the data pin of a whole snapshot on every rising clock edge */
+struct snapshot_shift_register : an_component {
+        uint8_t value = 0;
+        unsigned clocks = 0;
+        void attach() override {watch(3);}
+        void changed(uint8_t pin, float voltage, unsigned long long t) override
+        {
+                if (voltage < 3)
+                        return;
+                an_pin_snapshot_t snap = an_snapshot_pins();
+                value = value << 1 | (snap.voltage[2] > 3);
+                clocks++;
+        }
+};
+
+unsigned isr_snapshots;
+void on_clock() {an_snapshot_pins(); isr_snapshots++;}
+
+void test()
+{
+        an_board& board = an_current_board();
+
+        /* a writer flips all pins together in one section, a reader never sees them apart */
+        std::atomic<bool> done{false};
+        std::thread writer([&] {
+                float old[AN_MAX_PINS];
+                const uint64_t all = (1ULL << AN_MAX_PINS) - 1;
+                for (unsigned i = 0; i < 200000; i++) {
+                        board.pins.begin_write();
+                        board.pins.drive(all, i & 1 ? all : 0, old);
+                        board.pins.end_write();
+                }
+                done = true;
+        });
+        unsigned torn = 0, snapshots = 0;
+        while (!done) {
+                an_pin_snapshot_t snap = board.pins.snapshot();
+                for (unsigned pin = 1; pin < AN_MAX_PINS; pin++)
+                        torn += snap.voltage[pin] != snap.voltage[0];
+                snapshots++;
+        }
+        writer.join();
+        CHECK_EQ(torn, 0u);
+        CHECK(snapshots > 0);
+        board.pins.reset();
+
+        /* components and ISRs run inside the write section of shiftOut() */
+        auto reg = std::make_shared<snapshot_shift_register>();
+        an_attach_component(reg);
+        attachInterrupt(digitalPinToInterrupt(3), on_clock, RISING);
+        shiftOut(2, 3, MSBFIRST, 0xa5);
+        delay(1);
+        CHECK_EQ(reg->clocks, 8u);
+        CHECK_EQ(reg->value, 0xa5);
+        CHECK_EQ(isr_snapshots, 8u);
+        an_detach_component(reg);
+}
+
+int main()
+{
+        an_check_on_board(test);
+        return an_check_result();
+}
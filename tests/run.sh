@@ -0,0 +1,38 @@
+#!/bin/sh
+# Builds every test with ASan and UBSan and runs it, CXX picks the compiler.
+# session.cpp is built to record and to replay, and both runs have to print the same.
+cd "$(dirname "$0")" || exit 1
+CXX=${CXX:-g++}
+mkdir -p build
+failed=0
+build()
+{
+        $CXX -std=c++17 -g -O1 -pthread -fsanitize=address,undefined,float-divide-by-zero,float-cast-overflow -fno-sanitize-recover=all "$@"
+}
+fail()
+{
+        echo "FAIL $1"
+        failed=1
+}
+for test in *.cpp; do
+        name=${test%.cpp}
+        if [ "$name" = session ]; then
+                continue
+        elif ! build "$test" -o "build/$name"; then
+                fail "$name (build)"
+        elif ! (cd build && timeout 300 "./$name" > "$name.log" 2>&1); then
+                fail "$name, see tests/build/$name.log"
+        else
+                echo "ok   $name"
+        fi
+done
+if ! build -DAN_RECORD session.cpp -o build/session_record || ! build -DAN_REPLAY session.cpp -o build/session_replay; then
+        fail "session (build)"
+elif ! (cd build && timeout 300 ./session_record > session_record.out 2> session.log &&
+        timeout 300 ./session_replay > session_replay.out 2>> session.log &&
+        cmp session_record.out session_replay.out >> session.log 2>&1); then
+        fail "session, see tests/build/session.log"
+else
+        echo "ok   session"
+fi
+exit $failed
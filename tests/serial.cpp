@@ -0,0 +1,64 @@
+// Serial receive and parseInt()/parseFloat() with Arduino's sign and lookahead rules
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+static void receive(const char* text)
+{
+        Serial.an_receive((const uint8_t*)text, strlen(text));
+}
+static void drain()
+{
+        while (Serial.read() >= 0)
+                ;
+}
+
+int main()
+{
+        CHECK_EQ(Serial.peek(), -1);
+        CHECK_EQ(Serial.read(), -1);
+
+        /* a '-' only counts in front of the digits */
+        receive("--5 ");
+        CHECK_EQ(Serial.parseInt(), -5l);
+        receive("5-3 ");
+        CHECK_EQ(Serial.parseInt(), 5l);
+        CHECK_EQ(Serial.parseInt(), -3l);
+        receive("x--2.5 ");
+        CHECK_EQ(Serial.parseFloat(), -2.5f);
+        receive("42");
+        CHECK_EQ(Serial.parseInt(), 42l);
+        drain();
+
+        /* the ignore character is skipped inside the number */
+        receive("1,234\n");
+        CHECK_EQ(Serial.parseInt(SKIP_ALL, ','), 1234l);
+        drain();
+
+        /* SKIP_NONE stops at the first character that isn't part of a number */
+        receive("a12 ");
+        CHECK_EQ(Serial.parseInt(SKIP_NONE), 0l);
+        CHECK_EQ(Serial.peek(), 'a');
+        CHECK_EQ(Serial.parseInt(SKIP_ALL), 12l);
+        drain();
+
+        /* readStringUntil() and find() take the terminator and the target */
+        receive("one;two");
+        CHECK(Serial.readStringUntil(';') == "one");
+        CHECK_EQ(Serial.peek(), 't');
+        drain();
+        receive("abcOKdef");
+        CHECK(Serial.find("OK"));
+        CHECK_EQ(Serial.read(), 'd');
+        drain();
+
+        /* a number wrapped around the end of the ring is gathered */
+        std::string fill(AN_SERIAL_RX_BUFFER_SIZE - 4, ' ');
+        receive(fill.c_str());
+        drain();
+        receive("-123456789,");
+        CHECK_EQ(Serial.parseInt(), -123456789l);
+        CHECK_EQ(Serial.read(), ',');
+        return an_check_result();
+}
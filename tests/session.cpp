@@ -0,0 +1,57 @@
+/* A sketch fed from a generator, an ISR, another thread and real time. run.sh
+ * builds it with AN_RECORD and with AN_REPLAY, and the replay has to print
+ * exactly what the recording printed. */
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+
+volatile unsigned long edges = 0;
+void on_edge() {edges++;}
+
+int main()
+{
+        std::atomic<bool> done{false};
+        /* input from another thread arrives whenever it does while recording */
+        std::thread sender([&done] {
+                for (uint8_t c = 'a'; !done; c = c == 'z' ? 'a' : c + 1) {
+                        Serial.an_receive(&c, 1);
+                        std::this_thread::sleep_for(std::chrono::microseconds(700));
+                }
+        });
+
+        an_board& board = an_default_board;
+        board.setup_fn = [] {
+                Serial.begin(9600);
+                randomSeed(micros());
+                an_attach_square(2, 500);
+                an_attach_sine(A0, 3);
+                attachInterrupt(digitalPinToInterrupt(2), on_edge, CHANGE);
+        };
+        board.loop_fn = [] {
+                String rx;
+                while (Serial.available())
+                        rx += (char)Serial.read();
+                noInterrupts();
+                unsigned long seen = edges;
+                interrupts();
+                Serial.print(millis());
+                Serial.print(' ');
+                Serial.print(micros());
+                Serial.print(' ');
+                Serial.print(random(1000));
+                Serial.print(' ');
+                Serial.print(analogRead(A0));
+                Serial.print(' ');
+                Serial.print(digitalRead(2));
+                Serial.print(' ');
+                Serial.print(seen);
+                Serial.print(' ');
+                Serial.println(rx);
+                delay(2);
+        };
+        board.max_loops = 200;
+        board.run();
+        done = true;
+        sender.join();
+        return 0;
+}
@@ -0,0 +1,65 @@
+// CSV and VCD stimulus files, with records for pins the board doesn't have
+#define AN_VIRTUAL_TIME
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+static void write_file(const char* path, const char* text)
+{
+        FILE* file = fopen(path, "w");
+        fputs(text, file);
+        fclose(file);
+}
+
+int main()
+{
+        an_board& board = an_current_board();
+        write_file("stimulus.csv",
+                   "time,pin,voltage\n"
+                   "0.001,2,5\n"
+                   "0.002,300,5\n"
+                   "0.003,99999999999,5\n"
+                   "0.004,A2,3.5\n"
+                   "0.005,A9,1\n"
+                   "0.006,2,0\n");
+        int id = an_play_stimulus("stimulus.csv");
+        CHECK(id >= 0);
+        an_advance_time(1500);
+        CHECK_EQ(board.pins.get(2), 5.0f);
+        an_advance_time(3000);
+        CHECK_EQ(board.pins.get(A2), 3.5f);
+        an_advance_time(2000);
+        CHECK_EQ(board.pins.get(2), 0.0f);
+
+        write_file("stimulus.vcd",
+                   "$timescale 1 us $end\n"
+                   "$var wire 1 ! pin3 $end\n"
+                   "$var wire 1 \" pin99 $end\n"
+                   "$var real 1 # A1 $end\n"
+                   "$enddefinitions $end\n"
+                   "#10\n1!\n1\"\nr2.5 #\n"
+                   "#20\n0!\n");
+        CHECK(an_play_stimulus("stimulus.vcd") >= 0);
+        an_advance_time(15);
+        CHECK_EQ(board.pins.get(3), 5.0f);
+        CHECK_EQ(board.pins.get(A1), 2.5f);
+        an_advance_time(10);
+        CHECK_EQ(board.pins.get(3), 0.0f);
+
+        /* ids don't wrap, the 257th stimulus doesn't replace the first */
+        write_file("first.csv", "0.001,4,5\n");
+        write_file("other.csv", "0.001,5,5\n");
+        write_file("stopped.csv", "0.001,6,5\n");
+        const int first = an_play_stimulus("first.csv");
+        for (int i = 0; i < 300; i++)
+                CHECK(an_play_stimulus("other.csv") != first);
+        an_stop_stimulus(an_play_stimulus("stopped.csv"));
+        an_advance_time(2000);
+        CHECK_EQ(board.pins.get(4), 5.0f);
+        CHECK_EQ(board.pins.get(5), 5.0f);
+        CHECK_EQ(board.pins.get(6), 0.0f);
+
+        CHECK_EQ(an_play_stimulus("missing.csv"), -1);
+        return an_check_result();
+}
@@ -0,0 +1,81 @@
+// String against Arduino semantics, and the bounded heap of AN_STRING_HEAP
+#define AN_STRING_HEAP 256
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+int main()
+{
+        /* conversions */
+        CHECK(String(-5) == "-5");
+        CHECK(String(255, HEX) == "ff");
+        // BIN writes every bit of the type
+        CHECK(String((uint8_t)5, BIN) == "00000101");
+        CHECK(String(3.14159, 2) == "3.14");
+        CHECK(String(1.5f) == "1.5");
+        CHECK(String('x') == "x");
+        CHECK_EQ(String("12abc").toInt(), 12l);
+        CHECK_EQ(String(" 42").toInt(), 42l);
+        CHECK_EQ(String("abc").toInt(), 0l);
+        CHECK_EQ(String("-2.5").toFloat(), -2.5f);
+
+        /* substring() ends before right, and swaps a left past right */
+        String s = "hello world";
+        CHECK(s.substring(6) == "world");
+        CHECK(s.substring(0, 5) == "hello");
+        CHECK(s.substring(5, 0) == "hello");
+        CHECK(s.substring(20) == "");
+        CHECK(s.substring(6, 100) == "world");
+
+        /* searches give -1 when nothing is found */
+        CHECK_EQ(s.indexOf('o'), 4);
+        CHECK_EQ(s.indexOf('o', 5), 7);
+        CHECK_EQ(s.indexOf("xyz"), -1);
+        CHECK_EQ(s.indexOf('z'), -1);
+        CHECK_EQ(s.lastIndexOf('o'), 7);
+        CHECK_EQ(s.lastIndexOf('o', 6), 4);
+        CHECK_EQ(s.lastIndexOf("q"), -1);
+
+        /* remove() takes everything from index without a count */
+        String r = "abcdef";
+        r.remove(4);
+        CHECK(r == "abcd");
+        r.remove(1, 2);
+        CHECK(r == "ad");
+        r.remove(10);
+        CHECK(r == "ad");
+
+        String t = "  Mixed Case\t";
+        t.trim();
+        CHECK(t == "Mixed Case");
+        CHECK(t.equalsIgnoreCase("mixed case"));
+        CHECK(t.startsWith("Mixed"));
+        CHECK(t.startsWith("Case", 6));
+        CHECK(t.endsWith("Case"));
+        CHECK(!t.endsWith("Mixed Case!"));
+        t.replace("Case", "Cases");
+        CHECK(t == "Mixed Cases");
+        t.replace('s', 'z');
+        CHECK(t == "Mixed Cazez");
+        CHECK_EQ(t.charAt(100), '\0');
+
+        char buf[4];
+        t.toCharArray(buf, sizeof(buf));
+        CHECK(strcmp(buf, "Mix") == 0);
+
+        /* the heap takes length + 1 bytes per String and refuses what doesn't fit */
+        an_board& board = an_current_board();
+        const size_t used = board.string_heap;
+        {
+                String big;
+                CHECK(big.reserve(40));
+                CHECK_EQ(board.string_heap.load(), used + 41);
+                CHECK(!big.reserve(AN_STRING_HEAP));
+                String rest;
+                CHECK(!rest.concat(std::string(AN_STRING_HEAP - 40, 'x').c_str()));
+                CHECK(rest == "");
+        }
+        CHECK_EQ(board.string_heap.load(), used);
+        return an_check_result();
+}
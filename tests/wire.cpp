@@ -0,0 +1,94 @@
+// endTransmission() status codes and reads against device models on the bus
+#define AN_VIRTUAL_TIME
+#define AN_NO_MAIN
+#define AN_IMPL
+#include "../ArduinoNative.hpp"
+#include "check.hpp"
+
+// acknowledges its address but refuses any data
+struct an_refusing_device : an_i2c_device {
+        bool receive(const uint8_t* data, const size_t len) {return !len;}
+        size_t request(uint8_t* buf, const size_t len) {return 0;}
+};
+
+static int received = 0;
+
+int main()
+{
+        an_check_on_board([] {
+                Wire.begin();
+                auto sensor = std::make_shared<an_i2c_registers>();
+                sensor->set(0x75, 0x68);
+                Wire.an_attach(0x68, sensor);
+                Wire.an_attach(0x20, std::make_shared<an_refusing_device>());
+                auto eeprom = std::make_shared<an_i2c_eeprom>(4096, 32, 2, 5000);
+                Wire.an_attach(0x50, eeprom);
+
+                /* 4 without beginTransmission(), 2 for an address nobody answers */
+                CHECK_EQ(Wire.endTransmission(), 4);
+                Wire.beginTransmission(0x10);
+                Wire.write(0x00);
+                CHECK_EQ(Wire.endTransmission(), 2);
+                Wire.beginTransmission(0x20);
+                CHECK_EQ(Wire.endTransmission(), 0);
+                Wire.beginTransmission(0x20);
+                Wire.write(0x01);
+                CHECK_EQ(Wire.endTransmission(), 3);
+                // the transmission ended even when it failed
+                CHECK_EQ(Wire.endTransmission(), 4);
+
+                /* register reads continue from the selected register */
+                Wire.beginTransmission(0x68);
+                Wire.write(0x75);
+                CHECK_EQ(Wire.endTransmission(false), 0);
+                CHECK_EQ(Wire.requestFrom(0x68, 2), 2);
+                CHECK_EQ(Wire.read(), 0x68);
+                CHECK_EQ(Wire.read(), 0x00);
+                CHECK_EQ(Wire.read(), -1);
+
+                /* nothing answers a read of a missing device */
+                CHECK_EQ(Wire.requestFrom(0x11, 4), 0);
+                CHECK_EQ(Wire.available(), 0);
+                // a device that sends less than asked for leaves the bus high
+                CHECK_EQ(Wire.requestFrom(0x20, 2), 2);
+                CHECK_EQ(Wire.read(), 0xff);
+
+                /* the EEPROM NACKs its address during the write cycle */
+                Wire.beginTransmission(0x50);
+                Wire.write(0x00);
+                Wire.write(0x10);
+                Wire.write(0xab);
+                CHECK_EQ(Wire.endTransmission(), 0);
+                Wire.beginTransmission(0x50);
+                CHECK_EQ(Wire.endTransmission(), 2);
+                delay(6);
+                Wire.beginTransmission(0x50);
+                Wire.write(0x00);
+                Wire.write(0x10);
+                CHECK_EQ(Wire.endTransmission(), 0);
+                CHECK_EQ(Wire.requestFrom(0x50, 1), 1);
+                CHECK_EQ(Wire.read(), 0xab);
+
+                /* the buffer holds AN_WIRE_BUFFER_SIZE bytes */
+                Wire.beginTransmission(0x68);
+                for (int i = 0; i < AN_WIRE_BUFFER_SIZE; i++)
+                        CHECK_EQ(Wire.write(0), (size_t)1);
+                CHECK_EQ(Wire.write(0), (size_t)0);
+                CHECK_EQ(Wire.endTransmission(), 0);
+
+                /* a master reaches the sketch when it is a slave */
+                Wire.begin(0x08);
+                Wire.onReceive([](int num_bytes) {received = num_bytes;});
+                Wire.onRequest([] {Wire.write(0x42);});
+                const uint8_t data[3] = {1, 2, 3};
+                CHECK_EQ(Wire.an_master_write(0x08, data, 3), 0);
+                CHECK_EQ(received, 3);
+                CHECK_EQ(Wire.read(), 1);
+                uint8_t reply[2];
+                CHECK_EQ(Wire.an_master_read(0x08, reply, 2), (size_t)2);
+                CHECK_EQ(reply[0], 0x42);
+                CHECK_EQ(reply[1], 0xff);
+                CHECK(Wire.an_bus_us() > 0);
+        });
+        return an_check_result();
+}